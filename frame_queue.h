@@ -0,0 +1,95 @@
+// Trunk-Recorder Status Over UDP Plugin - Frame Queue
+// ********************************
+// Bounded lock-free queue between the trunk-recorder callbacks (producers)
+// and a shard's sender thread (the single consumer). Each slot carries a
+// sequence number, so producers claim slots with one CAS and never wait on
+// each other or on the consumer; a full queue makes push() fail instead.
+// ********************************
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+template <typename T>
+class FrameQueue {
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+
+    alignas(64) std::atomic<std::size_t> head{0};  // Next slot to claim, shared by producers.
+    alignas(64) std::atomic<std::size_t> tail{0};  // Next slot to read, consumer only.
+
+    static std::size_t round_up(std::size_t n) {
+        std::size_t size = 2;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+public:
+    // Capacity is rounded up to a power of two.
+    explicit FrameQueue(std::size_t capacity)
+        : slots(new Slot[round_up(capacity)]), mask(round_up(capacity) - 1)
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    FrameQueue(const FrameQueue&) = delete;
+    FrameQueue& operator=(const FrameQueue&) = delete;
+
+    std::size_t capacity() const { return mask + 1; }
+
+    // Any thread. Returns false if the queue is full.
+    bool push(const T& value) {
+        std::size_t pos = head.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & mask];
+            std::size_t seq = slot->seq.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = value;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only. Returns false if the queue is empty.
+    bool pop(T& value) {
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        Slot& slot = slots[pos & mask];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        value = slot.value;
+        slot.seq.store(pos + mask + 1, std::memory_order_release);
+        tail.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate; exact only when producers are idle.
+    std::size_t size() const {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        return h > t ? h - t : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+};
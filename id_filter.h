@@ -0,0 +1,105 @@
+// Trunk-Recorder Status Over UDP Plugin - Id Filters
+// ********************************
+// Allow/deny filters over talkgroup and radio ids. Each filter is compiled
+// into one bit per id, so checking an event is a shift, a load and a mask
+// no matter how many ids or ranges were configured.
+// ********************************
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <json.hpp>
+
+// Talkgroup ids are 16 bits, P25 radio ids are 24 bits (2 MB as a bitmap).
+const std::uint32_t TALKGROUP_ID_BITS = 1u << 16;
+const std::uint32_t RADIO_ID_BITS     = 1u << 24;
+
+class IdFilter {
+    std::vector<std::uint64_t> bits;    // Empty when no filter is configured.
+    std::uint32_t size = 0;
+    bool outside = true;                // Verdict for ids beyond the bitmap.
+
+    void assign(std::uint32_t lo, std::uint32_t hi, bool value) {
+        if (lo >= size) {
+            return;
+        }
+        hi = hi < size ? hi : size - 1;
+        for (std::uint32_t id = lo; id <= hi; ) {
+            // Whole words at a time once aligned; a full radio range is 262144 words, not 16M bits.
+            if ((id & 63) == 0 && hi - id >= 63) {
+                bits[id >> 6] = value ? ~0ull : 0ull;
+                id += 64;
+            } else {
+                if (value) {
+                    bits[id >> 6] |= 1ull << (id & 63);
+                } else {
+                    bits[id >> 6] &= ~(1ull << (id & 63));
+                }
+                if (id == hi) {
+                    break;
+                }
+                ++id;
+            }
+        }
+    }
+
+    // Accepts 1234, "1234" or "1000-1999".
+    static void parse_range(const nlohmann::json& item, std::uint32_t& lo, std::uint32_t& hi) {
+        if (item.is_number_unsigned()) {
+            lo = hi = item.get<std::uint32_t>();
+            return;
+        }
+        std::string text = item.get<std::string>();
+        std::size_t dash = text.find('-');
+        lo = static_cast<std::uint32_t>(std::stoul(text.substr(0, dash)));
+        hi = dash == std::string::npos ? lo : static_cast<std::uint32_t>(std::stoul(text.substr(dash + 1)));
+        if (hi < lo) {
+            throw std::invalid_argument("range '" + text + "' is backwards");
+        }
+    }
+
+public:
+    IdFilter() = default;
+
+    // Compile {"allow": [...], "deny": [...]}. An id passes if it is allowed (or
+    // no allow list is given) and not denied. Throws on malformed entries.
+    IdFilter(const nlohmann::json& settings, std::uint32_t id_bits) {
+        bool has_allow = settings.contains("allow");
+        bool has_deny  = settings.contains("deny");
+        if (!has_allow && !has_deny) {
+            return;
+        }
+
+        size = id_bits;
+        outside = !has_allow;
+        bits.assign((id_bits + 63) / 64, has_allow ? 0ull : ~0ull);
+
+        std::uint32_t lo, hi;
+        if (has_allow) {
+            for (const auto& item : settings.at("allow")) {
+                parse_range(item, lo, hi);
+                assign(lo, hi, true);
+            }
+        }
+        if (has_deny) {
+            for (const auto& item : settings.at("deny")) {
+                parse_range(item, lo, hi);
+                assign(lo, hi, false);
+            }
+        }
+    }
+
+    bool enabled() const { return !bits.empty(); }
+
+    bool pass(std::uint32_t id) const {
+        if (bits.empty()) {
+            return true;
+        }
+        if (id >= size) {
+            return outside;
+        }
+        return (bits[id >> 6] >> (id & 63)) & 1;
+    }
+};
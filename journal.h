@@ -0,0 +1,133 @@
+// Trunk-Recorder Status Over UDP Plugin - Packet Journal
+// ********************************
+// A journal is a flat capture of every packet the plugin emitted, so a day's
+// traffic can be replayed later with status_udp_replay.
+//
+//   File:   JournalHeader, then zero or more records.
+//   Record: JournalRecord, then `len` bytes of packet data.
+//
+// All fields are host byte order, the same as Packet itself.
+// ********************************
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#pragma pack(push, 1)
+struct JournalHeader {
+    char          magic[4] = {'M', 'C', 'J', '1'};
+    std::uint32_t version  = 1;
+    std::uint64_t start_ns = 0;     // CLOCK_REALTIME when the journal was opened
+};
+
+struct JournalRecord {
+    std::uint64_t ts_ns = 0;        // CLOCK_REALTIME when the packet was emitted
+    std::uint16_t len   = 0;        // Bytes of packet data following this record
+    std::uint16_t reserved = 0;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(JournalHeader) == 16, "JournalHeader must be 16 bytes");
+static_assert(sizeof(JournalRecord) == 12, "JournalRecord must be 12 bytes");
+
+inline bool journal_magic(const void* data) {
+    return std::memcmp(data, "MCJ1", 4) == 0;
+}
+
+// Appends records to a journal through a large stdio buffer, flushing at most
+// once a second so the hot path costs a memcpy rather than a syscall.
+class JournalWriter {
+    std::FILE* fp = nullptr;
+    std::uint64_t last_flush_ns = 0;
+
+public:
+    JournalWriter() = default;
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+    ~JournalWriter() { close(); }
+
+    bool open(const std::string& path, std::uint64_t now_ns) {
+        close();
+        fp = std::fopen(path.c_str(), "ab");
+        if (fp == nullptr) {
+            return false;
+        }
+        std::setvbuf(fp, nullptr, _IOFBF, 1 << 16);
+
+        // Only a fresh file gets a header; appending continues an existing journal.
+        std::fseek(fp, 0, SEEK_END);
+        if (std::ftell(fp) == 0) {
+            JournalHeader hdr{};
+            hdr.start_ns = now_ns;
+            std::fwrite(&hdr, sizeof(hdr), 1, fp);
+        }
+        last_flush_ns = now_ns;
+        return true;
+    }
+
+    bool is_open() const { return fp != nullptr; }
+
+    void write(std::uint64_t ts_ns, const void* data, std::uint16_t len) {
+        if (fp == nullptr) {
+            return;
+        }
+        JournalRecord rec{};
+        rec.ts_ns = ts_ns;
+        rec.len   = len;
+        std::fwrite(&rec, sizeof(rec), 1, fp);
+        std::fwrite(data, len, 1, fp);
+
+        if (ts_ns - last_flush_ns >= 1000000000ull) {
+            std::fflush(fp);
+            last_flush_ns = ts_ns;
+        }
+    }
+
+    void close() {
+        if (fp != nullptr) {
+            std::fclose(fp);
+            fp = nullptr;
+        }
+    }
+};
+
+// Reads records back in file order. `next()` returns false at end of file or
+// on a truncated trailing record (e.g. the recorder was killed mid-write).
+class JournalReader {
+    std::FILE* fp = nullptr;
+
+public:
+    JournalReader() = default;
+    JournalReader(const JournalReader&) = delete;
+    JournalReader& operator=(const JournalReader&) = delete;
+    ~JournalReader() { if (fp != nullptr) std::fclose(fp); }
+
+    bool open(const std::string& path) {
+        fp = std::fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        JournalHeader hdr{};
+        if (std::fread(&hdr, sizeof(hdr), 1, fp) != 1 || !journal_magic(hdr.magic) || hdr.version != 1) {
+            std::fclose(fp);
+            fp = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    bool next(std::uint64_t& ts_ns, std::string& data) {
+        JournalRecord rec{};
+        if (fp == nullptr || std::fread(&rec, sizeof(rec), 1, fp) != 1) {
+            return false;
+        }
+        data.resize(rec.len);
+        if (rec.len != 0 && std::fread(&data[0], rec.len, 1, fp) != 1) {
+            return false;
+        }
+        ts_ns = rec.ts_ns;
+        return true;
+    }
+};
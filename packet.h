@@ -0,0 +1,499 @@
+// Trunk-Recorder Status Over UDP Plugin - Wire Format
+// ********************************
+// Everything a consumer needs to decode what the plugin sends.
+//
+// Legacy framing (the default) sends each Packet as its own datagram.
+// Version 2 framing prefixes a bundle of Packets with a FrameHeader that
+// carries the sender's instance id and a sequence number, so a receiver can
+// tell lost and reordered frames apart (see SeqTracker), and can add parity
+// frames from which a lost frame is rebuilt (see FecDecoder).
+//
+//   Datagram (legacy): Packet
+//   Datagram (v2):     FrameHeader, then `count` Packets
+//   Parity (v2):       FrameHeader, ParityInfo, then `packets` Packet-sized blocks
+//
+// All fields are host byte order.
+// ********************************
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Alais C++ types to Rust types.
+using u8  = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+
+enum Type : u8 {
+    Type_Invalid = 0,
+    Unit_On = 1,
+    Unit_Off = 2,
+    Unit_AckResp = 3,
+    Unit_Join = 4,
+    Unit_Data = 5,
+    Unit_AnsReq = 6,
+    Unit_Location = 7,
+    Unit_PTTP = 8, // Push to Talk Pressed
+    Group_Roster = 9, // Radios affiliated to a talkgroup; a RosterPacket
+    Snapshot_Begin = 10, // Brackets a snapshot of unit state; see below
+    Snapshot_End = 11,
+};
+static_assert(std::is_same_v<std::underlying_type_t<Type>, u8>, "Type must be u8");
+
+// Flags or'd into Packet::typ; the low four bits are the Type.
+const u8 TYPE_INFERRED = 0x80;      // Not heard on the air but deduced by the plugin, e.g. a Unit_Off for a radio gone quiet.
+const u8 TYPE_SNAPSHOT = 0x40;      // Part of a snapshot: a radio's state as of `ts`, not a new event.
+
+// Decalared Before Defined.
+inline bool alias_eq(const char* a, const char* b);
+
+// Packets
+#pragma pack(push, 1)
+struct Packet {
+    // Header: 4 Bytes (32 bits - 4 Bytes)
+    char hdr[2] = {'M', 'C'};       // Prefix: 'M','C'
+    Type typ = Type::Type_Invalid;  // Type: 1 byte
+    u8   len = 8;                   // Size: Whole packet size, including Header, System, Radio, Payload. Size = Len * 4;
+
+    // System: 4 Bytes (32 bits - 4 Bytes)
+    u32  p25Id = 0;                 // [31:20] = SystemID (12b), [19:0] = WACN (20b)
+
+    // Radio: 20 Bytes (160 bits - 20 Bytes)
+    u16  nac = 0;                   // NAC
+    u16  tgId = 0;                  // Talk Group ID
+    u32  radioId = 0;               // Radio's Src ID
+    char alias[12] = {0};           // Radio's Alias
+
+    // Payload: 4 Bytes (32 Bits - 4 Bytes)
+    u32  ts = 0;                    // Time Stamp (UNIX Epoch Seconds)
+
+    bool operator==(const Packet& o) const {
+        return
+            typ == o.typ &&
+            len == o.len &&
+            p25Id == o.p25Id &&
+            nac == o.nac &&
+            tgId == o.tgId &&
+            radioId == o.radioId &&
+            alias_eq(alias, o.alias) &&
+            ts == o.ts;
+    }
+};
+#pragma pack(pop)
+
+static_assert(sizeof(Packet) == 32, "Packet must be 32 bytes");
+static_assert(alignof(Packet) == 1, "Packet must be packed");
+
+// Packet Helpers
+inline constexpr u16 p25_system_id(u32 p) {
+    return static_cast<u16>(p >> 20);
+}
+inline constexpr u32 p25_wacn(u32 p) {
+    return p & 0xFFFFFu;
+}
+inline constexpr u16 p25_nac (u32 p) {
+    return p & 0x0FFFu;
+}
+inline constexpr std::size_t payload_bytes(const Packet& p) {
+    return static_cast<std::size_t>(p.len) * 4;
+}
+inline constexpr Type base_type(Type t) {
+    return static_cast<Type>(t & 0x0F);
+}
+inline constexpr bool type_has_talkgroup(Type t) {
+    return t == Type::Unit_Join || t == Type::Unit_AnsReq || t == Type::Unit_Location || t == Type::Unit_PTTP;
+}
+inline constexpr bool valid_hdr(const Packet& p) {
+    return p.hdr[0] == 'M' && p.hdr[1] == 'C';
+}
+constexpr u32 make_p25id(u16 sysId, u32 wacn) {
+    return (u32(sysId & 0x0FFF) << 20) | (wacn & 0xFFFFF);
+}
+inline void stringToChar12(const std::string& input, char out[12]) {
+    // Since strncpy already null-pads when the source is shorter
+    std::strncpy(out, input.c_str(), 11);
+
+    // Ensure the last element is always null
+    out[11] = '\0';
+}
+inline bool alias_eq(const char* a, const char* b) {
+    return std::strcmp(a, b) == 0;
+}
+
+// ********************************
+// Talkgroup rosters
+// ********************************
+// A roster lists the radios affiliated to a talkgroup, in ascending order,
+// four to a Group_Roster packet, in as many packets as it takes. A talkgroup
+// whose last radio left gets one packet with a total of 0.
+
+#pragma pack(push, 1)
+struct RosterPacket {
+    char hdr[2] = {'M', 'C'};
+    Type typ = Type::Group_Roster;
+    u8   len = 8;
+    u32  p25Id = 0;
+    u16  nac = 0;
+    u16  tgId = 0;
+    u16  first = 0;                 // Position of radios[0] in the roster.
+    u16  total = 0;                 // Radios in the whole roster.
+    u32  radios[4] = {};            // 0 past the end of the roster.
+};
+#pragma pack(pop)
+
+static_assert(sizeof(RosterPacket) == sizeof(Packet), "RosterPacket must be Packet sized");
+
+// ********************************
+// Snapshots
+// ********************************
+// On request (a SnapshotRequest) or periodically, each sender shard streams
+// every radio it knows about: a Snapshot_Begin packet, then one packet per
+// radio, then a Snapshot_End. A radio packet has TYPE_SNAPSHOT or'd into the
+// type of the radio's last event, `tgId` the talkgroup it is affiliated to
+// (0 if none) and `ts` when it was last heard. In both markers `nac` is the
+// shard, `tgId` numbers the snapshot and `radioId` counts the radio packets
+// between them. Live events keep flowing meanwhile, so a radio packet older
+// than an event already applied for that radio is stale.
+
+// ********************************
+// Version 2 framing
+// ********************************
+
+// Frame flags
+const u8 FRAME_RETRANSMIT = 0x01;  // Resent in answer to a NackRequest; seq is the original one.
+const u8 FRAME_PARITY     = 0x02;  // XOR parity over `count` data frames from `seq` on; see FecEncoder.
+
+#pragma pack(push, 1)
+struct FrameHeader {
+    char hdr[2] = {'M', 'F'};       // Prefix: 'M','F' ('M','C' is a bare legacy Packet)
+    u8   version = 2;
+    u8   flags = 0;                 // FRAME_* bits
+    u32  instance = 0;              // Random per plugin start; sequence numbers restart with it.
+    u16  stream = 0;                // Sender shard. Each (instance, stream) numbers its frames independently.
+    u16  count = 0;                 // Packets following this header; data frames covered, for parity.
+    u32  seq = 0;                   // Frame sequence number, per destination and stream; first covered, for parity.
+};
+
+// Follows the FrameHeader of a parity frame, and is followed by `packets`
+// Packet-sized blocks of XOR parity.
+struct ParityInfo {
+    u16  count_xor = 0;             // XOR of the covered frames' packet counts.
+    u16  packets = 0;               // Largest packet count among them; shorter frames count as zero padded.
+    u32  reserved = 0;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FrameHeader) == 16, "FrameHeader must be 16 bytes");
+static_assert(sizeof(ParityInfo) == 8, "ParityInfo must be 8 bytes");
+
+inline constexpr bool valid_frame_hdr(const FrameHeader& f) {
+    return f.hdr[0] == 'M' && f.hdr[1] == 'F' && f.version == 2;
+}
+
+// ********************************
+// Control messages
+// ********************************
+// Sent by receivers to the plugin's control_port.
+
+#pragma pack(push, 1)
+// Ask for frames [first_seq, first_seq + count) of one stream to be sent
+// again. Only frames still in the sender's history are resent.
+struct NackRequest {
+    char hdr[2] = {'M', 'N'};
+    u8   version = 2;
+    u8   reserved = 0;
+    u32  instance = 0;              // From the FrameHeader; requests for another run are ignored.
+    u16  stream = 0;
+    u16  count = 0;
+    u32  first_seq = 0;
+    u16  port = 0;                  // Port the frames were sent to, telling destinations on one host apart.
+    u16  reserved2 = 0;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(NackRequest) == 20, "NackRequest must be 20 bytes");
+
+inline constexpr bool valid_nack(const NackRequest& n) {
+    return n.hdr[0] == 'M' && n.hdr[1] == 'N' && n.version == 2;
+}
+
+#pragma pack(push, 1)
+// Ask for a snapshot of unit state, sent to the destination on the
+// requester's host at `port`.
+struct SnapshotRequest {
+    char hdr[2] = {'M', 'S'};
+    u8   version = 2;
+    u8   reserved = 0;
+    u16  port = 0;
+    u16  reserved2 = 0;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(SnapshotRequest) == 8, "SnapshotRequest must be 8 bytes");
+
+inline constexpr bool valid_snapshot_request(const SnapshotRequest& r) {
+    return r.hdr[0] == 'M' && r.hdr[1] == 'S' && r.version == 2;
+}
+
+// ********************************
+// Receiving
+// ********************************
+
+// decode_frame()
+//   Split a received datagram into its header and packets. A legacy datagram
+//   yields a zeroed header with count 1. A parity frame yields no packets;
+//   hand it to FecDecoder::recover(). Returns false if it is none of these.
+inline bool decode_frame(const void* data, std::size_t len, FrameHeader& frame, const Packet*& pkts) {
+    const char* p = static_cast<const char*>(data);
+    if (len == sizeof(Packet) && p[0] == 'M' && p[1] == 'C') {
+        frame = FrameHeader{};
+        frame.version = 0;
+        frame.count = 1;
+        pkts = reinterpret_cast<const Packet*>(p);
+        return true;
+    }
+    if (len < sizeof(FrameHeader)) {
+        return false;
+    }
+    std::memcpy(&frame, p, sizeof(frame));
+    if (!valid_frame_hdr(frame)) {
+        return false;
+    }
+    if (frame.flags & FRAME_PARITY) {
+        ParityInfo info;
+        if (len < sizeof(FrameHeader) + sizeof(info)) {
+            return false;
+        }
+        std::memcpy(&info, p + sizeof(FrameHeader), sizeof(info));
+        pkts = nullptr;
+        return len == sizeof(FrameHeader) + sizeof(info) + std::size_t(info.packets) * sizeof(Packet);
+    }
+    if (len != sizeof(FrameHeader) + std::size_t(frame.count) * sizeof(Packet)) {
+        return false;
+    }
+    pkts = reinterpret_cast<const Packet*>(p + sizeof(FrameHeader));
+    return true;
+}
+
+// Receiver-side loss accounting for one (instance, stream). Feed it the
+// header of every v2 data frame received (not parity frames); a frame is counted lost as soon as a
+// later one arrives, and taken off the lost count again if it turns up
+// within the last 64 sequence numbers.
+class SeqTracker {
+    bool started = false;
+    u32 instance = 0;
+    u32 next = 0;                   // Sequence number expected next.
+    std::uint64_t window = 0;       // Bit i: seq (next - 1 - i) has been received.
+
+public:
+    enum Result { InOrder, Gap, Late, Duplicate, Restart };
+
+    std::uint64_t received = 0;
+    std::uint64_t lost = 0;         // Not (yet) received.
+    std::uint64_t reordered = 0;    // Arrived after a later frame.
+    std::uint64_t duplicates = 0;
+    std::uint64_t restarts = 0;     // Sender instance changes.
+
+    Result update(const FrameHeader& frame) {
+        if (!started || frame.instance != instance) {
+            restarts += started ? 1 : 0;
+            started = true;
+            instance = frame.instance;
+            next = frame.seq + 1;
+            window = 1;
+            received += 1;
+            return Restart;
+        }
+
+        std::int32_t ahead = static_cast<std::int32_t>(frame.seq - next);
+        if (ahead >= 0) {
+            std::uint64_t skipped = static_cast<std::uint64_t>(ahead);
+            lost += skipped;
+            window = skipped + 1 >= 64 ? 1 : (window << (skipped + 1)) | 1;
+            next = frame.seq + 1;
+            received += 1;
+            return skipped == 0 ? InOrder : Gap;
+        }
+
+        std::uint32_t age = next - 1 - frame.seq;
+        if (age < 64) {
+            if ((window >> age) & 1) {
+                duplicates += 1;
+                return Duplicate;
+            }
+            window |= 1ull << age;
+        }
+        // Older than the window: assume it is late rather than a duplicate.
+        if (lost != 0) {
+            lost -= 1;
+        }
+        reordered += 1;
+        received += 1;
+        return Late;
+    }
+
+    // Sequence number expected next. Read it before update(): on a Gap, the
+    // frames from here up to the new one are the missing ones.
+    u32 expected() const { return next; }
+
+    // Fraction of frames lost so far.
+    double loss_rate() const {
+        std::uint64_t total = received + lost;
+        return total == 0 ? 0.0 : static_cast<double>(lost) / static_cast<double>(total);
+    }
+};
+
+// ********************************
+// Forward error correction
+// ********************************
+// Every `k` consecutive data frames of a stream are followed by a parity
+// frame holding their XOR, so a receiver can rebuild any one lost frame of
+// the group without asking for it. Frames shorter than the longest in the
+// group count as zero padded.
+
+// Sender side. Feed it each data frame once it has been sent.
+class FecEncoder {
+    std::size_t k = 0;
+    std::size_t frames = 0;                 // Data frames in the current group.
+    u32 next_seq = 0;
+    FrameHeader hdr;
+    ParityInfo info;
+    std::vector<std::uint64_t> parity;      // Four words per packet.
+
+public:
+    explicit FecEncoder(std::size_t k = 0) : k(k) {}
+
+    std::size_t group() const { return k; }
+
+    // Returns true when the frame completes a group; header(), info() and
+    // data() then make up its parity frame, until the next add().
+    bool add(const FrameHeader& frame, const Packet* pkts) {
+        if (k == 0) {
+            return false;
+        }
+        // A break in the numbering (a failed send gives its numbers back) starts a new group.
+        if (frames != 0 && (frame.seq != next_seq || frame.instance != hdr.instance || frame.stream != hdr.stream)) {
+            frames = 0;
+        }
+        if (frames == 0) {
+            hdr = FrameHeader{};
+            hdr.flags    = FRAME_PARITY;
+            hdr.instance = frame.instance;
+            hdr.stream   = frame.stream;
+            hdr.seq      = frame.seq;
+            info = ParityInfo{};
+            parity.clear();
+        }
+
+        std::size_t words = std::size_t(frame.count) * sizeof(Packet) / 8;
+        if (parity.size() < words) {
+            parity.resize(words, 0);
+        }
+        const char* bytes = reinterpret_cast<const char*>(pkts);
+        for (std::size_t i = 0; i < words; ++i) {
+            std::uint64_t w;
+            std::memcpy(&w, bytes + i * 8, 8);
+            parity[i] ^= w;
+        }
+        info.count_xor ^= frame.count;
+        info.packets = std::max(info.packets, frame.count);
+
+        next_seq = frame.seq + 1;
+        if (++frames < k) {
+            return false;
+        }
+        hdr.count = static_cast<u16>(k);
+        frames = 0;
+        return true;
+    }
+
+    const FrameHeader& header() const { return hdr; }
+    const ParityInfo& parity_info() const { return info; }
+    const void* data() const { return parity.data(); }
+    std::size_t data_len() const { return std::size_t(info.packets) * sizeof(Packet); }
+};
+
+// Receiver side, for one stream. Remembers the last `window` data frames
+// (at least the group size) and rebuilds the missing one when a parity
+// frame arrives for a group with exactly one frame lost.
+class FecDecoder {
+    struct Slot {
+        bool valid = false;
+        u32 instance = 0;
+        u32 seq = 0;
+        std::vector<Packet> pkts;
+    };
+    std::vector<Slot> ring;
+
+public:
+    explicit FecDecoder(std::size_t window = 256) : ring(window) {}
+
+    void add(const FrameHeader& frame, const Packet* pkts) {
+        Slot& slot = ring[frame.seq % ring.size()];
+        slot.valid = true;
+        slot.instance = frame.instance;
+        slot.seq = frame.seq;
+        slot.pkts.assign(pkts, pkts + frame.count);
+    }
+
+    // `data` is the whole parity datagram. On success the rebuilt frame is
+    // in `frame` and `pkts`, and has been add()ed.
+    bool recover(const void* data, std::size_t len, FrameHeader& frame, std::vector<Packet>& pkts) {
+        FrameHeader parity;
+        const Packet* none;
+        if (!decode_frame(data, len, parity, none) || !(parity.flags & FRAME_PARITY) || parity.count > ring.size()) {
+            return false;
+        }
+        ParityInfo info;
+        std::memcpy(&info, static_cast<const char*>(data) + sizeof(FrameHeader), sizeof(info));
+
+        std::size_t missing = 0;
+        u32 missing_seq = 0;
+        for (u32 i = 0; i < parity.count; ++i) {
+            const Slot& slot = ring[(parity.seq + i) % ring.size()];
+            if (!slot.valid || slot.seq != parity.seq + i || slot.instance != parity.instance) {
+                ++missing;
+                missing_seq = parity.seq + i;
+            }
+        }
+        if (missing != 1) {
+            return false;
+        }
+
+        std::vector<std::uint64_t> acc(std::size_t(info.packets) * sizeof(Packet) / 8);
+        std::memcpy(acc.data(), static_cast<const char*>(data) + sizeof(FrameHeader) + sizeof(info), acc.size() * 8);
+        u16 count = info.count_xor;
+        for (u32 i = 0; i < parity.count; ++i) {
+            if (parity.seq + i == missing_seq) {
+                continue;
+            }
+            const Slot& slot = ring[(parity.seq + i) % ring.size()];
+            const char* bytes = reinterpret_cast<const char*>(slot.pkts.data());
+            std::size_t words = std::min(acc.size(), slot.pkts.size() * sizeof(Packet) / 8);
+            for (std::size_t w = 0; w < words; ++w) {
+                std::uint64_t v;
+                std::memcpy(&v, bytes + w * 8, 8);
+                acc[w] ^= v;
+            }
+            count ^= static_cast<u16>(slot.pkts.size());
+        }
+        if (count > info.packets) {
+            return false;
+        }
+
+        frame = FrameHeader{};
+        frame.instance = parity.instance;
+        frame.stream   = parity.stream;
+        frame.count    = count;
+        frame.seq      = missing_seq;
+        pkts.resize(count);
+        std::memcpy(static_cast<void*>(pkts.data()), acc.data(), std::size_t(count) * sizeof(Packet));
+        add(frame, pkts.data());
+        return true;
+    }
+};
@@ -0,0 +1,99 @@
+// Trunk-Recorder Status Over UDP Plugin - Rate Limiting
+// ********************************
+// Token buckets, and an error aggregator built on one so that an outage
+// produces a few log lines rather than one per packet.
+// ********************************
+#pragma once
+
+#include <cstdint>
+
+class TokenBucket {
+    double rate = 0;            // Tokens per second; 0 means unlimited.
+    double burst = 0;
+    double tokens = 0;
+    std::uint64_t last_ns = 0;
+
+    void refill(std::uint64_t now_ns) {
+        if (now_ns > last_ns) {
+            tokens += rate * static_cast<double>(now_ns - last_ns) / 1e9;
+            if (tokens > burst) {
+                tokens = burst;
+            }
+        }
+        last_ns = now_ns;
+    }
+
+public:
+    TokenBucket() = default;
+    TokenBucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst) {}
+
+    bool unlimited() const { return rate <= 0; }
+
+    // Take n tokens if available.
+    bool take(std::uint64_t now_ns, double n = 1) {
+        if (unlimited()) {
+            return true;
+        }
+        refill(now_ns);
+        if (tokens < n) {
+            return false;
+        }
+        tokens -= n;
+        return true;
+    }
+
+    // Nanoseconds until n tokens will be available; 0 if they are now.
+    std::uint64_t wait_ns(std::uint64_t now_ns, double n = 1) {
+        if (unlimited()) {
+            return 0;
+        }
+        refill(now_ns);
+        return tokens >= n ? 0 : static_cast<std::uint64_t>((n - tokens) / rate * 1e9) + 1;
+    }
+};
+
+// The first few occurrences of an error are logged as they happen; after
+// that one line per window summarises how many there were and the last
+// errno seen.
+class ErrorLimiter {
+    TokenBucket bucket;
+    std::uint64_t window_ns;
+    std::uint64_t window_start = 0;
+    std::uint64_t suppressed = 0;
+    int last_err = 0;
+
+public:
+    explicit ErrorLimiter(std::uint64_t window_ns = 10000000000ull, double burst = 3)
+        : bucket(1e9 / static_cast<double>(window_ns), burst), window_ns(window_ns) {}
+
+    // Record `count` occurrences. Returns true if the first should be logged
+    // on its own; the rest are left for the summary.
+    bool record(std::uint64_t now_ns, int err, std::uint64_t count = 1) {
+        last_err = err;
+        bool log_one = suppressed == 0 && bucket.take(now_ns);
+        if (log_one) {
+            count -= 1;
+        }
+        if (count != 0) {
+            if (suppressed == 0) {
+                window_start = now_ns;
+            }
+            suppressed += count;
+        }
+        return log_one;
+    }
+
+    // Once a window has passed with suppressed occurrences, hand back their
+    // count and the last errno, and start a new window.
+    bool summary(std::uint64_t now_ns, std::uint64_t& count, int& err) {
+        if (suppressed == 0 || now_ns - window_start < window_ns) {
+            return false;
+        }
+        count = suppressed;
+        err = last_err;
+        suppressed = 0;
+        return true;
+    }
+
+    std::uint64_t window_s() const { return window_ns / 1000000000ull; }
+};
@@ -0,0 +1,73 @@
+// Trunk-Recorder Status Over UDP Plugin - Read Epochs
+// ********************************
+// Tells a writer when no reader can still hold an object it has unpublished,
+// so the object can be freed. Readers bracket every use with enter() and
+// leave(), which count them in one of two counters picked by the current
+// phase; nothing else is shared, and a reader never waits.
+//
+// An object unpublished during phase p is safe to free once the phase has
+// moved past p and the counter of phase p has since drained: every reader
+// that could have loaded it entered in phase p or earlier, and the phase
+// only moves on once the other counter is empty. A reader that entered in
+// an older phase was waited for when the phase moved past it.
+//
+// The writer side (phase(), quiescent(), advance()) must be serialized by
+// the caller.
+// ********************************
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+class ReadEpoch {
+    std::atomic<std::uint64_t> phase_{0};
+    std::atomic<std::uint64_t> active[2] = {{0}, {0}};
+
+public:
+    // Count a reader in, returning the phase to pass to leave(). The phase is checked again after counting,
+    // so a reader is never counted in a phase that has already moved on.
+    std::uint64_t enter() {
+        for (;;) {
+            std::uint64_t p = phase_.load();
+            active[p & 1].fetch_add(1);
+            if (phase_.load() == p) {
+                // Orders the caller's loads, acquire ones included, after the count a writer may check.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return p;
+            }
+            active[p & 1].fetch_sub(1);
+        }
+    }
+
+    void leave(std::uint64_t p) { active[p & 1].fetch_sub(1, std::memory_order_release); }
+
+    // Current phase; read after unpublishing an object, to tag it with.
+    std::uint64_t phase() const { return phase_.load(); }
+
+    // Whether no reader of the previous phase is left: everything tagged with an older phase can be freed,
+    // and the phase may be advanced.
+    bool quiescent() const { return active[(phase_.load() + 1) & 1].load() == 0; }
+
+    // Move to the next phase; only once quiescent().
+    void advance() { phase_.fetch_add(1); }
+};
+
+// Holds a reader in for as long as it is in scope.
+class ReadSection {
+    ReadEpoch* epoch;
+    std::uint64_t p;
+
+public:
+    explicit ReadSection(ReadEpoch& epoch) : epoch(&epoch), p(epoch.enter()) {}
+    ~ReadSection() { leave(); }
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+
+    // Leave early, e.g. before sleeping; nothing read under the section may be used after this.
+    void leave() {
+        if (epoch) {
+            epoch->leave(p);
+            epoch = nullptr;
+        }
+    }
+};
@@ -0,0 +1,266 @@
+// Trunk-Recorder Status Over UDP Plugin - Shared Memory Ring
+// ********************************
+// Single-producer, multi-consumer ring of frames in a POSIX shared memory
+// object, for consumers on the same host. The producer never waits for
+// readers: each reader keeps its own cursor and, if it falls a whole ring
+// behind, skips ahead and counts what it missed. Every slot is a seqlock,
+// so a reader can tell a frame it copied from one overwritten meanwhile.
+//
+// In the steady state neither side makes a system call. A reader that runs
+// out of frames registers as a waiter and sleeps on a futex; the producer
+// only calls futex_wake when there is a waiter.
+//
+//   Object: ShmRingHeader, then `slot_count` slots of `slot_stride` bytes.
+//   Slot:   ShmSlot, then up to `slot_bytes` bytes of frame.
+//
+// The object outlives the producer, so readers can stay attached across a
+// restart; a producer reopening a ring of the same geometry carries on from
+// its head.
+//
+// Readers map the ring read-write, since they register as waiters in the
+// header. A reader running as another user needs write permission: give
+// the ring mode 0660 and a group it belongs to.
+// ********************************
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+struct ShmRingHeader {
+    char magic[4];                          // "MCR1"
+    std::uint32_t version;
+    std::uint32_t slot_bytes;               // Largest frame a slot holds.
+    std::uint32_t slot_stride;
+    std::uint64_t slot_count;
+    alignas(64) std::atomic<std::uint64_t> head;    // Frames ever written; frame n is in slot n % slot_count.
+    alignas(64) std::atomic<std::uint32_t> futex;   // Low 32 bits of head, for futex waits.
+    std::atomic<std::uint32_t> waiters;             // Readers asleep, or about to be.
+};
+
+struct ShmSlot {
+    std::atomic<std::uint64_t> version;     // 2n+1 while frame n is written, 2n+2 once it is complete.
+    std::uint32_t len;
+    std::uint32_t reserved;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+static_assert(sizeof(ShmSlot) == 16, "ShmSlot must be 16 bytes");
+
+// Maps a ring object; shared by the writer and the reader.
+class ShmMapping {
+protected:
+    void* map = nullptr;
+    std::size_t map_size = 0;
+    ShmRingHeader* hdr = nullptr;
+
+    ShmSlot* slot(std::uint64_t n) const {
+        return reinterpret_cast<ShmSlot*>(reinterpret_cast<char*>(hdr) + sizeof(ShmRingHeader) +
+                                          (n % hdr->slot_count) * hdr->slot_stride);
+    }
+
+    static long futex(std::atomic<std::uint32_t>* word, int op, std::uint32_t val, const timespec* timeout) {
+        return ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), op, val, timeout, nullptr, 0);
+    }
+
+    bool map_fd(int fd, std::size_t size) {
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        map = p;
+        map_size = size;
+        hdr = static_cast<ShmRingHeader*>(p);
+        return true;
+    }
+
+public:
+    ShmMapping() = default;
+    ShmMapping(const ShmMapping&) = delete;
+    ShmMapping& operator=(const ShmMapping&) = delete;
+    ~ShmMapping() { close(); }
+
+    bool is_open() const { return map != nullptr; }
+
+    void close() {
+        if (map != nullptr) {
+            ::munmap(map, map_size);
+            map = nullptr;
+            hdr = nullptr;
+        }
+    }
+};
+
+class ShmRing : public ShmMapping {
+public:
+    // Create the ring, or reuse an existing one with the same geometry. The
+    // object is given `mode` and, unless it is -1, `group`, whatever the
+    // umask and whoever created it before.
+    bool open(const std::string& name, std::uint64_t slot_count, std::uint32_t slot_bytes,
+              mode_t mode = 0644, gid_t group = static_cast<gid_t>(-1)) {
+        close();
+        std::uint32_t stride = static_cast<std::uint32_t>((sizeof(ShmSlot) + slot_bytes + 63) / 64 * 64);
+        std::size_t size = sizeof(ShmRingHeader) + slot_count * stride;
+
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, mode);
+        if (fd == -1) {
+            return false;
+        }
+        if ((group != static_cast<gid_t>(-1) && ::fchown(fd, static_cast<uid_t>(-1), group) != 0) || ::fchmod(fd, mode) != 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        struct stat st{};
+        bool reuse = ::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) == size;
+        if (!reuse && ::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            return false;
+        }
+        bool mapped = map_fd(fd, size);
+        int err = errno;
+        ::close(fd);
+        if (!mapped) {
+            errno = err;
+            return false;
+        }
+
+        if (!reuse || std::memcmp(hdr->magic, "MCR1", 4) != 0 || hdr->version != 1 ||
+            hdr->slot_bytes != slot_bytes || hdr->slot_stride != stride || hdr->slot_count != slot_count) {
+            // Fresh ring. Readers of an old one see head go backwards and start over.
+            std::memset(map, 0, sizeof(ShmRingHeader));
+            std::memcpy(hdr->magic, "MCR1", 4);
+            hdr->version = 1;
+            hdr->slot_bytes = slot_bytes;
+            hdr->slot_stride = stride;
+            hdr->slot_count = slot_count;
+            for (std::uint64_t i = 0; i < slot_count; ++i) {
+                slot(i)->version.store(0, std::memory_order_relaxed);
+            }
+            hdr->head.store(0, std::memory_order_release);
+        }
+        return true;
+    }
+
+    std::uint32_t slot_bytes() const { return hdr->slot_bytes; }
+
+    // Append one frame, gathered from iov. Returns false if it does not fit a slot.
+    bool write(const iovec* iov, std::size_t iovcnt) {
+        std::size_t len = 0;
+        for (std::size_t i = 0; i < iovcnt; ++i) {
+            len += iov[i].iov_len;
+        }
+        if (len > hdr->slot_bytes) {
+            return false;
+        }
+
+        std::uint64_t n = hdr->head.load(std::memory_order_relaxed);
+        ShmSlot* s = slot(n);
+        s->version.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        char* data = reinterpret_cast<char*>(s + 1);
+        for (std::size_t i = 0; i < iovcnt; ++i) {
+            std::memcpy(data, iov[i].iov_base, iov[i].iov_len);
+            data += iov[i].iov_len;
+        }
+        s->len = static_cast<std::uint32_t>(len);
+        s->version.store(2 * n + 2, std::memory_order_release);
+        hdr->head.store(n + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Wake sleeping readers after one or more write()s. Pairs with the fence in ShmRingReader::wait().
+    void publish() {
+        hdr->futex.store(static_cast<std::uint32_t>(hdr->head.load(std::memory_order_relaxed)), std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hdr->waiters.load(std::memory_order_relaxed) != 0) {
+            futex(&hdr->futex, FUTEX_WAKE, INT_MAX, nullptr);
+        }
+    }
+};
+
+// Reader side, for consumers. Starts at the live end of the ring.
+class ShmRingReader : public ShmMapping {
+    std::uint64_t cursor = 0;
+
+public:
+    std::uint64_t lost = 0;                 // Frames overwritten before this reader got to them.
+
+    bool open(const std::string& name) {
+        close();
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st{};
+        bool mapped = ::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(ShmRingHeader) &&
+                      map_fd(fd, static_cast<std::size_t>(st.st_size));
+        ::close(fd);
+        if (!mapped || std::memcmp(hdr->magic, "MCR1", 4) != 0 ||
+            sizeof(ShmRingHeader) + hdr->slot_count * hdr->slot_stride > map_size) {
+            close();
+            return false;
+        }
+        cursor = hdr->head.load(std::memory_order_acquire);
+        return true;
+    }
+
+    std::uint32_t slot_bytes() const { return hdr->slot_bytes; }
+
+    // Copy the next frame into buf (at least slot_bytes() long). Returns its
+    // length, or 0 if no frame is ready.
+    std::size_t read(void* buf) {
+        for (;;) {
+            std::uint64_t head = hdr->head.load(std::memory_order_acquire);
+            if (cursor > head) {
+                cursor = head;              // The producer started a fresh ring.
+            }
+            if (cursor == head) {
+                return 0;
+            }
+            if (head - cursor > hdr->slot_count) {
+                lost += head - cursor - hdr->slot_count;
+                cursor = head - hdr->slot_count;
+            }
+
+            ShmSlot* s = slot(cursor);
+            std::uint64_t v1 = s->version.load(std::memory_order_acquire);
+            if (v1 == 2 * cursor + 2) {
+                std::size_t len = std::min<std::size_t>(s->len, hdr->slot_bytes);
+                std::memcpy(buf, s + 1, len);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (s->version.load(std::memory_order_relaxed) == v1) {
+                    ++cursor;
+                    return len;
+                }
+            }
+            // Overwritten before or while we copied it.
+            ++lost;
+            ++cursor;
+        }
+    }
+
+    // Sleep until the producer publishes past our cursor, or timeout_ms passes.
+    void wait(int timeout_ms) {
+        hdr->waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::uint32_t seen = hdr->futex.load(std::memory_order_seq_cst);
+        if (seen == static_cast<std::uint32_t>(cursor)) {
+            timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+            futex(&hdr->futex, FUTEX_WAIT, seen, &ts);
+        }
+        hdr->waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
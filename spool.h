@@ -0,0 +1,191 @@
+// Trunk-Recorder Status Over UDP Plugin - Spool
+// ********************************
+// Bounded store-and-forward ring in a memory-mapped file. Packets a
+// destination cannot take are appended here and replayed once it recovers.
+// The ring lives in the file, so a backlog survives a restart too; when the
+// ring is full the oldest packets are dropped.
+//
+//   File:   SpoolHeader, then `capacity` bytes of ring.
+//   Record: u16 length, then that many bytes. A length of 0xFFFF (or fewer
+//           than two bytes left before the end) means "wrap to the start".
+//
+// Records read back are checked against the ring before use: a torn write
+// from a crash, or a damaged file, empties the spool rather than let a
+// length point past the data.
+//
+// Not thread safe; each spool belongs to one sender thread.
+// ********************************
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#pragma pack(push, 1)
+struct SpoolHeader {
+    char          magic[4] = {'M', 'C', 'S', '1'};
+    std::uint32_t version  = 1;
+    std::uint64_t capacity = 0;     // Bytes of ring after the header.
+    std::uint64_t head     = 0;     // Bytes ever written; write position is head % capacity.
+    std::uint64_t tail     = 0;     // Bytes ever consumed.
+    std::uint64_t dropped  = 0;     // Records overwritten because the ring was full.
+    std::uint8_t  reserved[24] = {0};
+};
+#pragma pack(pop)
+
+static_assert(sizeof(SpoolHeader) == 64, "SpoolHeader must be 64 bytes");
+
+class Spool {
+    int fd = -1;
+    std::uint8_t* map = nullptr;
+    std::size_t map_size = 0;
+    SpoolHeader* hdr = nullptr;
+    std::uint8_t* ring = nullptr;
+    std::uint16_t unit = 1;         // Every record is a whole number of these bytes.
+    std::uint64_t resets = 0;
+
+    static const std::uint16_t WRAP = 0xFFFF;
+
+    std::uint64_t contiguous(std::uint64_t offset) const {
+        return hdr->capacity - offset % hdr->capacity;
+    }
+
+    // Drop everything, after finding a record that cannot be right.
+    void discard() {
+        hdr->tail = hdr->head;
+        ++resets;
+    }
+
+public:
+    Spool() = default;
+    Spool(const Spool&) = delete;
+    Spool& operator=(const Spool&) = delete;
+    ~Spool() { close(); }
+
+    // Open or create the spool of records that are multiples of `record_unit`
+    // bytes. An existing file with the same capacity keeps its backlog;
+    // anything else is reset.
+    bool open(const std::string& path, std::uint64_t capacity, std::uint16_t record_unit = 1) {
+        close();
+        unit = record_unit != 0 ? record_unit : 1;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return false;
+        }
+
+        map_size = sizeof(SpoolHeader) + capacity;
+        struct stat st{};
+        bool reuse = ::fstat(fd, &st) == 0 && static_cast<std::uint64_t>(st.st_size) == map_size;
+        if (!reuse && ::ftruncate(fd, static_cast<off_t>(map_size)) != 0) {
+            close();
+            return false;
+        }
+
+        void* p = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        map  = static_cast<std::uint8_t*>(p);
+        hdr  = reinterpret_cast<SpoolHeader*>(map);
+        ring = map + sizeof(SpoolHeader);
+
+        if (!reuse || std::memcmp(hdr->magic, "MCS1", 4) != 0 || hdr->version != 1 ||
+            hdr->capacity != capacity || hdr->head < hdr->tail || hdr->head - hdr->tail > capacity) {
+            *hdr = SpoolHeader{};
+            hdr->capacity = capacity;
+        }
+        return true;
+    }
+
+    bool is_open() const { return map != nullptr; }
+    bool empty() const { return map == nullptr || hdr->head == hdr->tail; }
+    std::uint64_t bytes() const { return map == nullptr ? 0 : hdr->head - hdr->tail; }
+    std::uint64_t dropped() const { return map == nullptr ? 0 : hdr->dropped; }
+    std::uint64_t corrupt() const { return resets; }   // Times a bad record emptied the spool.
+
+    // Oldest record, without consuming it.
+    bool front(const std::uint8_t*& data, std::uint16_t& len) {
+        while (map != nullptr && hdr->tail < hdr->head) {
+            std::uint64_t pos = hdr->tail % hdr->capacity;
+            std::uint64_t room = contiguous(hdr->tail);
+            std::uint16_t l = 0;
+            if (room >= 2) {
+                std::memcpy(&l, ring + pos, 2);
+            }
+            if (room < 2 || l == WRAP) {
+                if (hdr->head - hdr->tail < room) {
+                    discard();
+                    return false;
+                }
+                hdr->tail += room;
+                continue;
+            }
+            if (l == 0 || l % unit != 0 || 2u + l > room || 2u + l > hdr->head - hdr->tail) {
+                discard();
+                return false;
+            }
+            data = ring + pos + 2;
+            len = l;
+            return true;
+        }
+        return false;
+    }
+
+    // Consume the record front() returned.
+    void pop() {
+        const std::uint8_t* data;
+        std::uint16_t len;
+        if (front(data, len)) {
+            hdr->tail += 2u + len;
+        }
+    }
+
+    // Append a record, dropping the oldest ones to make room.
+    bool push(const void* data, std::uint16_t len) {
+        std::uint64_t need = 2u + len;
+        if (map == nullptr || len == WRAP || need > hdr->capacity / 2) {
+            return false;
+        }
+
+        std::uint64_t room = contiguous(hdr->head);
+        std::uint64_t total = room < need ? room + need : need;
+        const std::uint8_t* oldest;
+        std::uint16_t oldest_len;
+        while (hdr->capacity - (hdr->head - hdr->tail) < total && front(oldest, oldest_len)) {
+            hdr->tail += 2u + oldest_len;
+            hdr->dropped += 1;
+        }
+
+        if (room < need) {
+            if (room >= 2) {
+                std::memcpy(ring + hdr->head % hdr->capacity, &WRAP, 2);
+            }
+            hdr->head += room;
+        }
+        std::uint64_t pos = hdr->head % hdr->capacity;
+        std::memcpy(ring + pos, &len, 2);
+        std::memcpy(ring + pos + 2, data, len);
+        hdr->head += need;
+        return true;
+    }
+
+    void close() {
+        if (map != nullptr) {
+            ::msync(map, map_size, MS_ASYNC);
+            ::munmap(map, map_size);
+            map = nullptr;
+            hdr = nullptr;
+            ring = nullptr;
+        }
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
@@ -6,9 +6,25 @@
 #include <time.h>
 #include <vector>
 #include <iostream>
+#include <fstream>
 #include <cstdlib>
+#include <cstdio>
 #include <string>
 #include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <tuple>
 #include "../../trunk-recorder/source.h"
 #include <json.hpp>
 #include "../../trunk-recorder/plugin_manager/plugin_api.h"
@@ -23,13 +39,32 @@
 #include <boost/log/sinks/text_ostream_backend.hpp>
 #include <boost/crc.hpp>
 
+#include "frame_queue.h"
+#include "id_filter.h"
+#include "journal.h"
+#include "packet.h"
+#include "rate_limit.h"
+#include "read_epoch.h"
+#include "shm_ring.h"
+#include "spool.h"
+#include "unit_state.h"
+
 // UDP Socket Includes.
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>      // getaddrinfo, freeaddrinfo
 #include <arpa/inet.h>
+#include <net/if.h>     // if_nametoindex
+#include <sys/un.h>     // sockaddr_un
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY, TCP_CORK
 #include <unistd.h>     // close
 #include <errno.h>
+#include <sys/stat.h>   // stat, for config_file change detection
+#include <grp.h>        // getgrnam_r, for shm:// group
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>    // pthread_setaffinity_np, pthread_setname_np
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR   -1
 typedef int SOCKET;
@@ -39,6 +74,21 @@ struct UdpTarget {
     socklen_t addrlen;
 };
 
+// Per-destination socket options, from the scheme and query part of the URI.
+struct UdpOptions {
+    int socktype = SOCK_DGRAM;      // SOCK_SEQPACKET for unix+seqpacket://, SOCK_STREAM for tcp://.
+    int ttl = -1;                   // Multicast TTL / hop limit; -1 leaves the system default (1).
+    std::string iface;              // Multicast interface, by name or IPv4 address.
+    int loopback = -1;              // Deliver multicast to listeners on this host too; -1 leaves the default (on).
+    std::string shm_name;           // shm:// ring; the link writes to shared memory instead of a socket.
+    std::uint64_t shm_slots = 8192;
+    std::uint32_t shm_slot_bytes = 2032;    // A 2 KiB slot with its ShmSlot header.
+    mode_t shm_mode = 0644;         // Readers need write access too, so other users need 0660 and shm_group.
+    gid_t shm_group = static_cast<gid_t>(-1);   // -1 keeps the plugin's group.
+    bool cork = false;              // tcp:// mode=throughput: TCP_CORK instead of TCP_NODELAY.
+    std::size_t tcp_buffer = 1 << 20;       // Bytes a tcp:// link buffers for a slow collector.
+};
+
 // Helper Consts
 const int PLUGIN_SUCCESS = 0;
 const int PLUGIN_FAILURE = 1;
@@ -46,94 +96,363 @@ const int PLUGIN_FAILURE = 1;
 using namespace std;
 namespace logging = boost::log;
 
-// Alais C++ types to Rust types.
-using u8  = std::uint8_t;
-using u16 = std::uint16_t;
-using u32 = std::uint32_t;
-
-enum Type : u8 {
-    Type_Invalid = 0,
-    Unit_On = 1,
-    Unit_Off = 2,
-    Unit_AckResp = 3,
-    Unit_Join = 4,
-    Unit_Data = 5,
-    Unit_AnsReq = 6,
-    Unit_Location = 7,
-    Unit_PTTP = 8, // Push to Talk Pressed
-};
-static_assert(std::is_same_v<std::underlying_type_t<Type>, u8>, "Type must be u8");
-
-// Decalared Before Defined.
-bool alias_eq(const char* a, const char* b);
-
-// Packets
-#pragma pack(push, 1)
-struct Packet {
-    // Header: 4 Bytes (32 bits - 4 Bytes)
-    char hdr[2] = {'M', 'C'};       // Prefix: 'M','C'
-    Type typ = Type::Type_Invalid;  // Type: 1 byte
-    u8   len = 8;                   // Size: Whole packet size, including Header, System, Radio, Payload. Size = Len * 4;
-
-    // System: 4 Bytes (32 bits - 4 Bytes)
-    u32  p25Id = 0;                 // [31:20] = SystemID (12b), [19:0] = WACN (20b)
-
-    // Radio: 20 Bytes (160 bits - 20 Bytes)
-    u16  nac = 0;                   // NAC
-    u16  tgId = 0;                  // Talk Group ID
-    u32  radioId = 0;               // Radio's Src ID
-    char alias[12] = {0};           // Radio's Alias
-
-    // Payload: 4 Bytes (32 Bits - 4 Bytes)
-    u32  ts = 0;                    // Time Stamp (UNIX Epoch Seconds)
-
-    bool operator==(const Packet& o) const {
-        return
-            typ == o.typ &&
-            len == o.len &&
-            p25Id == o.p25Id &&
-            nac == o.nac &&
-            tgId == o.tgId &&
-            radioId == o.radioId &&
-            alias_eq(alias, o.alias) &&
-            ts == o.ts;
-    }
+// Config names for each Type, indexed by value.
+const char* const TYPE_NAMES[] = {
+    "invalid", "on", "off", "ackresp", "join", "data", "ansreq", "location", "ptt", "roster",
 };
-#pragma pack(pop)
-
-static_assert(sizeof(Packet) == 32, "Packet must be 32 bytes");
-static_assert(alignof(Packet) == 1, "Packet must be packed");
+const u16 ALL_UNIT_TYPES = 0x01FE;  // Unit_On .. Unit_PTTP
 
-// Packet Helpers
-inline constexpr u16 p25_system_id(u32 p) {
-    return static_cast<u16>(p >> 20);
-}
-inline constexpr u32 p25_wacn(u32 p) {
-    return p & 0xFFFFFu;
-}
-inline constexpr u16 p25_nac (u32 p) {
-    return p & 0x0FFFu;
+inline std::uint64_t realtime_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
 }
-inline constexpr std::size_t payload_bytes(const Packet& p) {
-    return static_cast<std::size_t>(p.len) * 4;
+inline std::uint64_t monotonic_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
 }
-inline constexpr bool valid_hdr(const Packet& p) {
-    return p.hdr[0] == 'M' && p.hdr[1] == 'C';
-}
-constexpr u32 make_p25id(u16 sysId, u32 wacn) {
-    return (u32(sysId & 0x0FFF) << 20) | (wacn & 0xFFFFF);
-}
-inline void stringToChar12(const std::string& input, char out[12]) {
-    // Since strncpy already null-pads when the source is shorter
-    std::strncpy(out, input.c_str(), 11);
 
-    // Ensure the last element is always null
-    out[11] = '\0';
-}
-bool alias_eq(const char* a, const char* b) {
-    return std::strcmp(a, b) == 0;
+// SipHash-2-4 of data under a 128-bit key; a keyed hash whose outputs cannot be forged without the key.
+inline std::uint64_t siphash24(const std::uint64_t key[2], const void* data, std::size_t len) {
+    auto rotl = [](std::uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    std::uint64_t v0 = key[0] ^ 0x736f6d6570736575ull, v1 = key[1] ^ 0x646f72616e646f6dull;
+    std::uint64_t v2 = key[0] ^ 0x6c7967656e657261ull, v3 = key[1] ^ 0x7465646279746573ull;
+    auto round = [&] {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    std::size_t whole = len & ~static_cast<std::size_t>(7);
+    for (std::size_t i = 0; i <= whole; i += 8) {
+        std::uint64_t m = 0;
+        if (i < whole) {
+            std::memcpy(&m, p + i, 8);      // Little-endian hosts only, which is all trunk-recorder runs on.
+        } else {
+            for (std::size_t j = 0; j < (len & 7); ++j) {
+                m |= static_cast<std::uint64_t>(p[i + j]) << (8 * j);
+            }
+            m |= static_cast<std::uint64_t>(len & 0xFF) << 56;
+        }
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    v2 ^= 0xFF;
+    round();
+    round();
+    round();
+    round();
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
+// ********************************
+// Plugin Configuration
+// ********************************
+
+// Immutable snapshot of everything the hot path reads. Reloads build a new
+// snapshot off the hot path and publish it with a release store, so a
+// callback sees either the old or the new configuration, never a mix.
+struct UdpConfig {
+    std::uint64_t generation = 0;
+    bool unit_enabled = true;
+    u16 default_types = 0;              // Types enabled on systems without a "systems" entry.
+    std::vector<u16> system_types;      // Enabled types, one bit per Type, indexed by system number.
+    IdFilter talkgroups;                // Checked only for types that carry a talkgroup.
+    IdFilter radios;
+    std::vector<std::string> destinations;
+    std::size_t subscribers = 0;        // The last this many destinations are leases taken on control_port.
+
+    // Per-destination routing; bit d of a route mask stands for destinations[d]. Each rule narrows one table,
+    // so a packet's mask is two loads and an AND, plus a filter lookup for destinations with talkgroup rules.
+    bool routed = false;                // Some destination has rules; off, every destination takes everything.
+    std::uint64_t route_types[16] = {}; // Destinations taking each Type.
+    std::vector<std::uint64_t> route_systems;   // Destinations taking each system number...
+    std::uint64_t route_other_systems = 0;      // ...and systems beyond the table.
+    std::uint64_t route_filtered = 0;   // Destinations with a talkgroup filter...
+    std::vector<IdFilter> route_talkgroups;     // ...indexed by destination.
+
+    // Per-destination rate limits, indexed like destinations; empty if no destination is limited.
+    struct RateLimit {
+        double rate = 0;                // Packets per second to the destination; 0 for no limit.
+        double burst = 0;
+        double reserve = 0;             // Tokens of the burst only high-priority packets may use; bulk needs 1 + reserve.
+        double type_rate[16] = {};      // Packets per second of each Type; 0 for no limit.
+        bool coalesce = false;          // Hold packets over the limit, newest per radio and type, rather than drop them.
+
+        bool limited() const { return rate > 0 || std::any_of(type_rate, type_rate + 16, [](double r) { return r > 0; }); }
+    };
+    std::vector<RateLimit> rate_limits;
+
+    // Destination resolution
+    unsigned resolve_interval_s = 300;  // Re-resolve hostnames this often.
+    unsigned resolve_retry_s = 5;       // Retry a failed resolution this often.
+
+    // Socket recovery
+    unsigned backoff_min_ms = 100;
+    unsigned backoff_max_ms = 30000;
+    unsigned connect_timeout_ms = 5000;     // A tcp:// connect() not done by then fails, and is retried after the backoff.
+
+    // Shutdown
+    unsigned drain_timeout_ms = 2000;   // stop() gives queued packets this long to go out.
+
+    // Batching
+    std::size_t batch_max = 64;         // Packets per sendmmsg().
+    unsigned linger_us = 0;             // Wait this long for a partial batch to fill.
+
+    // Framing
+    bool framing_v2 = false;            // FrameHeader + bundled Packets instead of one bare Packet per datagram.
+    std::size_t frame_packets = 43;     // Packets per v2 frame; from frame_bytes.
+
+    // Retransmission on NackRequest (v2 framing and control_port only)
+    std::size_t nack_history = 0;       // Frames kept per destination; 0 disables.
+    u16 nack_types = 0;                 // Frames holding any of these types are kept.
+    double nack_rate = 200;             // Frames resent per second per destination.
+
+    // Priority
+    u16 high_types = 1u << Type::Unit_PTTP;     // Types that skip the bulk queue and the linger.
+
+    // Latest-value coalescing
+    u16 coalesce_types = 0;             // Bulk types held back, the newest per radio, and flushed every coalesce_ms.
+    unsigned coalesce_ms = 1000;
+
+    // Unit state
+    unsigned unit_timeout_s = 0;        // A radio silent this long is presumed off; 0 disables.
+    unsigned roster_interval_s = 0;     // Send every talkgroup's roster this often; 0 disables.
+    bool snapshots = false;             // Answer SnapshotRequests...
+    unsigned snapshot_interval_s = 0;   // ...and send every destination a snapshot this often; 0 for never.
+    double snapshot_rate = 2000;        // Snapshot packets per second per destination, after live traffic.
+
+    // Forward error correction (v2 framing only)
+    std::size_t fec_k = 0;              // A parity frame after every fec_k data frames; 0 disables.
+
+    // Store and forward; disabled while spool_dir is empty.
+    std::string spool_dir;
+    std::uint64_t spool_bytes = 64ull << 20;    // Ring size of each destination's spool file.
+    double spool_threshold = 0.5;       // With no destination up, spool once the queue is this full.
+    double catchup_rate = 1000;         // Spooled packets replayed per second, after live traffic.
+
+    bool track_units() const { return unit_timeout_s != 0 || roster_interval_s != 0 || snapshots; }
+
+    bool type_enabled(int sys_num, Type typ) const {
+        u16 mask = static_cast<std::size_t>(sys_num) < system_types.size() ? system_types[sys_num] : default_types;
+        return (mask >> typ) & 1;
+    }
+
+    std::uint64_t route_mask(std::size_t sys_num, const Packet& pkt) const {
+        std::uint64_t mask = route_types[pkt.typ & 0x0F] & (sys_num < route_systems.size() ? route_systems[sys_num] : route_other_systems);
+        std::uint64_t filtered = mask & route_filtered;
+        if (filtered != 0 && type_has_talkgroup(pkt.typ)) {
+            for (; filtered != 0; filtered &= filtered - 1) {
+                unsigned d = static_cast<unsigned>(__builtin_ctzll(filtered));
+                if (!route_talkgroups[d].pass(pkt.tgId)) {
+                    mask &= ~(1ull << d);
+                }
+            }
+        }
+        return mask;
+    }
+
+    // Whether a packet with route mask `routes` goes to destinations[d]. Without rules there can be more than 64.
+    bool routes_to(std::uint64_t routes, std::size_t d) const { return !routed || (d < 64 && ((routes >> d) & 1)); }
+};
+
+// A connected udp:// link that had failed counts as recovered after sending this long without an ICMP error.
+const std::uint64_t RECOVERY_NS = 1000000000ull;
+
+// Subscription changes are published at most this often, batched, so requests cannot churn out snapshots faster
+// than they are reclaimed.
+const std::uint64_t SUBSCRIPTION_RELOAD_NS = 1000000000ull;
+
+// A subscription cookie is good for the period it was issued in and the next.
+const std::uint64_t COOKIE_PERIOD_NS = 120ull * 1000000000ull;
+
+// Most packets a rate-limited link holds back for coalescing.
+const std::size_t HELD_MAX = 4096;
+
+// ********************************
+// Shards
+// ********************************
+
+// One destination as seen by one shard. Every shard has its own socket, so
+// shards never contend on a send.
+struct Link {
+    std::string dest;                       // Destination URI; target.addrlen is 0 until it resolves.
+    UdpTarget target{INVALID_SOCKET, {}, 0};
+    UdpOptions options;
+    ShmRing shm;                            // Open instead of target.sock for shm:// destinations.
+    std::string shm_name;                   // As opened, with the shard suffix.
+    bool connecting = false;                // tcp:// connect() in progress.
+    std::uint64_t connect_deadline = 0;     // ...given up on at this time.
+    std::string outbuf;                     // tcp:// bytes the socket would not take yet; whole frames only start here.
+
+    // After a failure the socket is closed and reopened at retry_at; the backoff doubles with every failure.
+    std::uint64_t retry_at = 0;
+    std::uint64_t backoff_ns = 0;
+    std::uint64_t sending_since = 0;        // First send that succeeded since the last failure.
+    ErrorLimiter send_errors;
+    ErrorLimiter unready;                   // Packets dropped while the link is down.
+    u32 seq = 0;                            // Next v2 frame sequence number.
+    std::vector<FrameHeader> headers;       // One per frame of the batch being sent.
+
+    // Recently sent frames that may be asked for again, indexed by seq % size.
+    struct HistoryFrame {
+        bool valid = false;
+        u32 seq = 0;
+        std::vector<Packet> pkts;
+    };
+    std::vector<HistoryFrame> history;
+    TokenBucket resend;
+    double resend_rate = -1;
+    std::uint64_t resent = 0;               // Counters since the last report.
+    std::uint64_t resend_missed = 0;        // Requested but no longer (or never) in history.
+    std::uint64_t resend_throttled = 0;
+
+    FecEncoder fec;
+
+    // Rate limit; see Status_Udp::rate_limit().
+    bool limited = false;
+    bool coalesce = false;
+    std::uint64_t limit_generation = 0;     // Config generation the buckets were built for.
+    UdpConfig::RateLimit limit_settings;    // ...and the settings, so a reload that keeps them keeps their tokens.
+    TokenBucket limit;
+    TokenBucket type_limits[16];
+    std::map<std::tuple<u32, u32, u8>, Packet> held;   // Over the limit, newest per system, radio and type.
+    std::uint64_t throttled = 0;            // Counters since the last report: packets dropped over the limit...
+    std::uint64_t coalesced = 0;            // ...and held ones a newer packet replaced.
+
+    // Packets the link could not take wait here, and are replayed at the catch-up rate once it is back.
+    Spool spool;
+    std::string spool_path;
+    TokenBucket catchup;
+    double catchup_rate = -1;
+    std::uint64_t replayed = 0;             // Since the spool last ran empty.
+    std::uint64_t spool_dropped_reported = 0;
+    std::uint64_t spool_corrupt_reported = 0;
+
+    // Snapshot being streamed to the destination, from its begin marker to its end marker.
+    std::vector<Packet> snapshot;
+    std::size_t snapshot_sent = 0;
+    TokenBucket snapshot_pace;
+
+    bool is_shm() const { return !options.shm_name.empty(); }
+    bool is_stream() const { return options.socktype == SOCK_STREAM; }
+    bool ready() const {
+        return is_shm() ? shm.is_open() : target.sock != INVALID_SOCKET && target.addrlen != 0 && !connecting;
+    }
+
+    Link() = default;
+    Link(const Link&) = delete;
+    Link& operator=(const Link&) = delete;
+    ~Link() {
+        if (target.sock != INVALID_SOCKET) {
+            ::close(target.sock);
+        }
+    }
+};
+
+// A packet queued for a sender thread, with the system it came from for routing.
+struct QueuedPacket {
+    Packet pkt;
+    u16 sys_num = 0;
+};
+
+// A radio, by system and radio id, and an event type; keys state kept per radio.
+struct RadioKey {
+    u32 p25Id;
+    u32 radioId;
+    u8 typ;
+
+    bool operator==(const RadioKey& o) const { return p25Id == o.p25Id && radioId == o.radioId && typ == o.typ; }
+};
+struct RadioKeyHash {
+    std::size_t operator()(const RadioKey& k) const {
+        return std::hash<std::uint64_t>()((static_cast<std::uint64_t>(k.p25Id) << 32 | k.radioId) * 0x9E3779B97F4A7C15ull ^ k.typ);
+    }
+};
+
+// Work for a sender thread from the control thread.
+struct ShardCommand {
+    enum Kind : u8 { Nack, Snapshot };
+    Kind kind = Nack;
+    sockaddr_storage from;                  // Requester.
+    NackRequest nack;
+    u16 port = 0;                           // Snapshot: port of the requester's destination.
+};
+
+// Systems are spread over shards. Each shard owns a queue, duplicate
+// suppression, sockets and a sender thread, so throughput scales with cores
+// and a noisy system never delays the systems of another shard. Within a
+// shard, high-priority types have a queue of their own that is always
+// served first.
+struct Shard {
+    Shard(unsigned index, std::size_t queue_size) : index(index), queue(queue_size), high(queue_size), commands(256) {}
+    ~Shard() {
+        if (wake_fd != -1) {
+            ::close(wake_fd);
+        }
+    }
+
+    unsigned index;
+    int cpu = -1;                           // Pin the sender thread to this CPU, if not -1.
+    FrameQueue<QueuedPacket> queue;         // Bulk.
+    FrameQueue<QueuedPacket> high;          // High priority.
+    FrameQueue<ShardCommand> commands;
+    int wake_fd = -1;                       // eventfd the sender thread sleeps on.
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> lingering{false};     // Waiting for a batch to fill; a high-priority packet cuts it short.
+    std::atomic<bool> stopping{false};
+    std::uint64_t drain_deadline = 0;       // Set before stopping; the sender gives up on the queue after it.
+    std::thread thread;
+    std::atomic<std::uint64_t> dropped{0};  // Packets lost to a full queue.
+    std::uint64_t dropped_reported = 0;
+    std::uint64_t next_report = 0;
+    std::uint64_t drained = 0;              // Packets taken off the queue after stop() began...
+    std::uint64_t drain_lost = 0;           // ...and sends of them that failed.
+
+    // Sender thread only.
+    Packet last_packet = Packet{};          // Make sure we don't send the same packet muliple times.
+    std::uint64_t generation = 0;           // Config generation the links were built for.
+    std::uint64_t resolve_generation = 0;   // Resolver generation the links were built for.
+    std::vector<std::unique_ptr<Link>> links;
+    std::vector<Packet> batch;
+    std::vector<u16> batch_systems;         // System number of each batch packet...
+    std::vector<std::uint64_t> batch_routes;    // ...and the destinations it is routed to.
+    std::vector<Packet> routed;             // The batch packets routed to one destination...
+    std::vector<Packet> limited;            // ...and those of them within its rate limit.
+    std::size_t batch_high = 0;             // High-priority packets at the front of the batch.
+
+    // Latest-value coalescing: bulk packets of cfg.coalesce_types wait in `coalescing`, one per radio and type,
+    // until flush_at; then they move to `flushing` and go out ahead of newer bulk packets.
+    std::unordered_map<RadioKey, std::size_t, RadioKeyHash> coalesce_index;    // Into coalescing.
+    std::vector<QueuedPacket> coalescing;
+    std::vector<QueuedPacket> flushing;
+    std::size_t flushed = 0;                // Packets of `flushing` already in a batch.
+    std::uint64_t flush_at = 0;
+    std::uint64_t coalesced = 0;            // Packets replaced by a newer one, since the last report.
+
+    // Radios heard on this shard's systems, and packets made from that state, sent after high-priority ones.
+    UnitTable units;
+    u32 units_time = 0;                     // Epoch second the unit timers last ran to.
+    std::deque<QueuedPacket> generated;
+    std::uint64_t inferred_off = 0;         // Radios presumed off, since the last report.
+    std::uint64_t next_roster = 0;
+    std::uint64_t next_snapshot = 0;
+    std::uint64_t next_state_save = 0;
+    u16 snapshot_id = 0;                    // Numbers this shard's snapshots.
+    std::vector<iovec> iov;                 // Per frame: FrameHeader (v2 only), then its packets.
+    std::vector<mmsghdr> msgs;
+    std::vector<u16> lengths;               // tcp:// length prefix of each frame, big endian.
+    std::vector<iovec> stream_iov;          // tcp:// prefixes and frames, in stream order.
+    std::vector<pollfd> pollfds;            // Sleep on: wake_fd, then tcp:// sockets waiting to be writable.
+
+    bool queues_empty() const { return high.empty() && queue.empty(); }
+    bool idle() const { return queues_empty() && coalescing.empty() && flushing.empty() && generated.empty(); }
+};
+
 class Status_Udp : public Plugin_Api
 {
     // Trunk-Recorder
@@ -143,16 +462,89 @@ class Status_Udp : public Plugin_Api
 
     // Plugin Settings
     std::string log_prefix = "\t[Status UDP]\t";
-    std::string udp_dest;
-    bool unit_enabled = true;
-
-    // Plugin Socket
-    UdpTarget udp_socket = UdpTarget {};
-    // Make sure we don't send the same packet muliple times.
-    Packet last_packet = Packet{};
+    std::string journal_path;
+    std::string config_file;
+    int config_poll_ms = 1000;
+    json base_config;           // This plugin's config.json section; config_file overrides it.
+    unsigned shard_count = 1;
+    std::vector<int> shard_cpus;
+    std::size_t queue_size = 4096;
+    u32 instance = 0;           // Identifies this run in v2 frame headers.
+    int control_port = 0;       // Receivers send NackRequests here; 0 disables.
+    bool subscriptions_enabled = false;     // Consumers may subscribe on control_port.
+    std::size_t max_subscriptions = 16;
+    unsigned max_lease_s = 300;
+    std::string state_file;     // Unit tables are saved to <state_file>.<shard>; empty disables.
+    unsigned state_interval_s = 300;
+    unsigned state_max_age_s = 3600;    // Radios not heard from for longer are not restored.
+
+    // Current configuration, read with a single acquire load by every callback, inside a read section of
+    // config_readers. Replaced snapshots are retired with the phase they were replaced in, and freed once every
+    // reader that could have loaded them has left.
+    std::atomic<const UdpConfig*> config{nullptr};
+    ReadEpoch config_readers;
+    std::mutex reload_mutex;
+    std::vector<std::pair<std::uint64_t, const UdpConfig*>> retired;
+
+    // config_file watcher
+    std::thread watcher;
+    std::mutex watcher_mutex;
+    std::condition_variable watcher_cv;
+    bool watcher_stop = false;
+
+    // Sender shards, and the shard of each system number. Fixed from init() on.
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<unsigned> system_shard;
+
+    // Resolved destination addresses, published by the resolver thread.
+    struct Resolution {
+        sockaddr_storage addr;
+        socklen_t addrlen;
+    };
+    std::mutex resolve_mutex;
+    std::map<std::string, Resolution> resolved;
+    std::atomic<std::uint64_t> resolve_generation{0};
+
+    // Resolver thread
+    std::thread resolver;
+    std::mutex resolver_mutex;
+    std::condition_variable resolver_cv;
+    bool resolver_stop = false;
+
+    // Control thread, listening on control_port.
+    std::thread control;
+    int control_sock = -1;
+    int control_wake_fd = -1;
+
+    // Leases taken on control_port, by destination URI. build_config() appends each to the destinations.
+    struct Subscription {
+        json rule;                  // A "destinations" entry.
+        std::uint64_t expires = 0;
+    };
+    std::mutex subscriptions_mutex;
+    std::map<std::string, Subscription> subscriptions;
+    // Control thread only: changes not yet published, and the answers to send once they are.
+    struct PendingReply {
+        sockaddr_storage to;
+        socklen_t tolen;
+        std::string text;
+    };
+    std::uint64_t cookie_key[2] = {0, 0};     // Keys the cookies that prove a subscriber gets our replies.
+    bool subscriptions_changed = false;
+    std::uint64_t next_subscription_reload = 0;
+    std::vector<PendingReply> pending_replies;
+
+    // Optional capture of every emitted packet, for status_udp_replay.
+    std::mutex journal_mutex;
+    JournalWriter journal;
 
 public:
     Status_Udp(){};
+    ~Status_Udp()
+    {
+        reclaim_retired(true);
+        delete config.load(std::memory_order_acquire);
+    }
 
     // ********************************
     // trunk-recorder messages
@@ -163,22 +555,21 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called when a call starts
     int call_start(Call *call) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        System* sys = call->get_system();
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_PTTP))
         {
-            System* sys = call->get_system();
+            // The talkgroup filter is checked before get_stats(), which builds a whole property tree.
+            long talkgroup_num = call->get_talkgroup();
+            if (!cfg->talkgroups.pass(talkgroup_num)) {
+                return PLUGIN_SUCCESS;
+            }
+
             boost::property_tree::ptree stat_node = call->get_stats();
             u32 source_id = stat_node.get<u32>("srcId");
 
-            Packet pkt{};
-            pkt.typ         = Type::Unit_PTTP;
-            pkt.p25Id       = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac         = p25_nac(sys->get_nac());
-            pkt.tgId        = call->get_talkgroup();
-            pkt.radioId     = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts          = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_PTTP, source_id, talkgroup_num);
         };
 
         return PLUGIN_SUCCESS;
@@ -189,17 +580,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each REGISTRATION message
     int unit_registration(System *sys, long source_id) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_On))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_On;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_On, source_id, 0);
         }
 
         return PLUGIN_SUCCESS;
@@ -210,17 +595,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each DEREGISTRATION message
     int unit_deregistration(System *sys, long source_id) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_Off))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_Off;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_Off, source_id, 0);
         }
 
         return PLUGIN_SUCCESS;
@@ -231,17 +610,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each ACKNOWLEDGE message
     int unit_acknowledge_response(System *sys, long source_id) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_AckResp))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_AckResp;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_AckResp, source_id, 0);
         }
 
         return PLUGIN_SUCCESS;
@@ -252,18 +625,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each AFFILIATION message
     int unit_group_affiliation(System *sys, long source_id, long talkgroup_num) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_Join))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_Join;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.tgId    = talkgroup_num;
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_Join, source_id, talkgroup_num);
         }
 
         return PLUGIN_SUCCESS;
@@ -274,17 +640,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each DATA_GRANT message
     int unit_data_grant(System *sys, long source_id) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_Data))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_Data;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_Data, source_id, 0);
         }
 
         return PLUGIN_SUCCESS;
@@ -294,18 +654,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each UU_ANS_REQ message
     int unit_answer_request(System *sys, long source_id, long talkgroup_num) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_AnsReq))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_AnsReq;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.tgId    = talkgroup_num;
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_AnsReq, source_id, talkgroup_num);
         }
 
         return PLUGIN_SUCCESS;
@@ -316,18 +669,11 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called each LOCATION message
     int unit_location(System *sys, long source_id, long talkgroup_num) override
     {
-        if (unit_enabled)
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (cfg->type_enabled(sys->get_sys_num(), Type::Unit_Location))
         {
-            Packet pkt{};
-            pkt.typ     = Type::Unit_Location;
-            pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
-            pkt.nac     = p25_nac(sys->get_nac());
-            pkt.tgId    = talkgroup_num;
-            pkt.radioId = source_id;
-            stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
-            pkt.ts      = time(NULL);
-
-            return send_packet(pkt);
+            return send_unit(*cfg, sys, Type::Unit_Location, source_id, talkgroup_num);
         }
 
         return PLUGIN_SUCCESS;
@@ -342,10 +688,67 @@ public:
     int parse_config(json config_data) override
     {
         // Get values from this plugin's config.json section and load into class variables.
-        udp_dest = config_data.value("destination", "udp://127.0.0.1:7767");
+        base_config = config_data;
+        journal_path = config_data.value("journal", "");
+        config_file = config_data.value("config_file", "");
+        config_poll_ms = config_data.value("config_poll_ms", 1000);
+        shard_count = std::max(1u, config_data.value("shards", 1u));
+        shard_cpus = config_data.value("shard_cpus", std::vector<int>());
+        queue_size = config_data.value("queue_size", static_cast<std::size_t>(4096));
+        control_port = config_data.value("control_port", 0);
+        if (config_data.contains("subscriptions")) {
+            const json& subs = config_data.at("subscriptions");
+            subscriptions_enabled = true;
+            std::random_device random;
+            cookie_key[0] = static_cast<std::uint64_t>(random()) << 32 | random();
+            cookie_key[1] = static_cast<std::uint64_t>(random()) << 32 | random();
+            max_subscriptions = subs.value("max", static_cast<std::size_t>(16));
+            max_lease_s = std::max(1u, subs.value("max_lease_s", 300u));
+        }
+        state_file = config_data.value("state_file", "");
+        state_interval_s = config_data.value("state_interval_s", 300u);
+        state_max_age_s = config_data.value("state_max_age_s", 3600u);
+
+        std::unique_ptr<UdpConfig> cfg = build_config(config_data);
+        if (!cfg) {
+            return PLUGIN_FAILURE;
+        }
+        if (subscriptions_enabled) {
+            // A subscription with rules turns routing on, which takes at most 64 destinations in all.
+            std::size_t room = cfg->destinations.size() < 64 ? 64 - cfg->destinations.size() : 0;
+            if (max_subscriptions > room) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "subscriptions max lowered to " << room << ", the room left by " << cfg->destinations.size() << " destinations";
+                max_subscriptions = room;
+            }
+        }
 
         // Print plugin startup info
-        BOOST_LOG_TRIVIAL(info) << log_prefix << "destination:            " << udp_dest << endl;
+        for (auto& dest : cfg->destinations) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "destination:            " << dest << endl;
+        }
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "unit_enabled:           " << cfg->unit_enabled << endl;
+        if (!journal_path.empty()) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "journal:                " << journal_path << endl;
+        }
+        if (!config_file.empty()) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "config_file:            " << config_file << endl;
+        }
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "shards:                 " << shard_count << endl;
+        if (control_port != 0) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "control_port:           " << control_port << endl;
+        }
+        if (subscriptions_enabled) {
+            if (control_port != 0) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "subscriptions:          " << max_subscriptions << ", lease up to " << max_lease_s << "s" << endl;
+            } else {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "subscriptions need control_port, ignored";
+            }
+        }
+        if (!state_file.empty()) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "state_file:             " << state_file << endl;
+        }
+
+        publish_config(std::move(cfg));
 
         return PLUGIN_SUCCESS;
     }
@@ -358,6 +761,23 @@ public:
         tr_sources = sources;
         tr_systems = systems;
         tr_config = config;
+        instance = std::random_device()();
+
+        // Now that system numbers are known, resolve the per-system type masks.
+        reload_config();
+
+        // Queues exist from here on, so events arriving before start() wait rather than vanish.
+        for (unsigned i = 0; i < shard_count; ++i) {
+            std::unique_ptr<Shard> shard(new Shard(i, queue_size));
+            shard->cpu = i < shard_cpus.size() ? shard_cpus[i] : -1;
+            shard->wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (shard->wake_fd == -1) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "eventfd failed: " << std::strerror(errno);
+                return PLUGIN_FAILURE;
+            }
+            shards.push_back(std::move(shard));
+        }
+        assign_system_shards();
 
         return PLUGIN_SUCCESS;
     }
@@ -366,17 +786,142 @@ public:
     //   TRUNK-RECORDER PLUGIN API: Called after trunk-recorder finishes setup and the plugin is initialized
     int start() override
     {
-        // Start the UDP connection
-        open_udp_connection();
+        if (!journal_path.empty() && !journal.open(journal_path, realtime_ns())) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Failed to open journal " << journal_path << ": " << std::strerror(errno);
+        }
+
+        load_units();
+
+        // Destinations resolve in the background; events stay queued until one is ready.
+        resolver_stop = false;
+        resolver = std::thread(&Status_Udp::resolver_loop, this);
+
+        // Start the sender threads; each opens its own UDP connections.
+        for (auto& shard : shards) {
+            shard->stopping = false;
+            shard->thread = std::thread(&Status_Udp::sender_loop, this, std::ref(*shard));
+        }
+
+        if (!config_file.empty()) {
+            watcher_stop = false;
+            watcher = std::thread(&Status_Udp::watch_config_file, this);
+        }
+
+        if (control_port != 0 && open_control_socket()) {
+            control = std::thread(&Status_Udp::control_loop, this);
+        }
 
         return PLUGIN_SUCCESS;
     }
 
     // stop()
+    //   TRUNK-RECORDER PLUGIN API: Called at shutdown. Flushes what is still queued within drain_timeout_ms,
+    //   reports what could not be sent, joins every thread and closes every socket.
     int stop() override
     {
-        // In the event that we choose to "connect" to a UDP socket,
-        // We would then remove that connection in the stop function.
+        if (control.joinable()) {
+            std::uint64_t one = 1;
+            ssize_t rc = ::write(control_wake_fd, &one, sizeof(one));
+            (void)rc;
+            control.join();
+        }
+        if (control_sock != -1) {
+            ::close(control_sock);
+            ::close(control_wake_fd);
+            control_sock = control_wake_fd = -1;
+        }
+
+        if (watcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(watcher_mutex);
+                watcher_stop = true;
+            }
+            watcher_cv.notify_all();
+            watcher.join();
+        }
+
+        // All shards drain in parallel against one deadline.
+        std::uint64_t started_ns = monotonic_ns();
+        std::uint64_t deadline = started_ns;
+        {
+            ReadSection section(config_readers);
+            deadline += 1000000ull * config.load(std::memory_order_acquire)->drain_timeout_ms;
+        }
+        for (auto& shard : shards) {
+            if (shard->thread.joinable()) {
+                shard->drain_deadline = deadline;
+                shard->stopping.store(true, std::memory_order_release);
+                wake(*shard, true);
+            }
+        }
+
+        for (auto& shard : shards) {
+            if (!shard->thread.joinable()) {
+                continue;
+            }
+            shard->thread.join();
+
+            // Whatever the sender did not get to goes to the spools if there are any, and is lost otherwise.
+            std::uint64_t left = 0;
+            std::uint64_t spooled = 0;
+            ReadSection section(config_readers);
+            const UdpConfig* cfg = config.load(std::memory_order_acquire);
+            std::vector<QueuedPacket> rest(shard->generated.begin(), shard->generated.end());
+            rest.insert(rest.end(), shard->flushing.begin() + static_cast<std::ptrdiff_t>(shard->flushed), shard->flushing.end());
+            rest.insert(rest.end(), shard->coalescing.begin(), shard->coalescing.end());
+            QueuedPacket queued;
+            while (shard->high.pop(queued) || shard->queue.pop(queued)) {
+                rest.push_back(queued);
+            }
+            // A reload racing shutdown can leave the links a generation behind cfg, so find each link's place in cfg.
+            std::vector<std::size_t> dest_of(shard->links.size());
+            for (std::size_t i = 0; i < shard->links.size(); ++i) {
+                auto it = std::find(cfg->destinations.begin(), cfg->destinations.end(), shard->links[i]->dest);
+                dest_of[i] = it != cfg->destinations.end() ? static_cast<std::size_t>(it - cfg->destinations.begin()) : SIZE_MAX;
+            }
+            for (const QueuedPacket& queued : rest) {
+                bool kept = false;
+                std::uint64_t routes = cfg->routed ? cfg->route_mask(queued.sys_num, queued.pkt) : 0;
+                for (std::size_t i = 0; i < shard->links.size(); ++i) {
+                    if (dest_of[i] != SIZE_MAX && cfg->routes_to(routes, dest_of[i])) {
+                        kept = shard->links[i]->spool.push(&queued.pkt, static_cast<u16>(sizeof(Packet))) || kept;
+                    }
+                }
+                ++(kept ? spooled : left);
+            }
+            for (const auto& link : shard->links) {
+                left += link->held.size();
+            }
+            shard->links.clear();
+            if (!state_file.empty() && cfg->track_units()) {
+                save_units(*shard);
+            }
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "Shard " << shard->index << " stopped: flushed " << shard->drained
+                                    << " queued packets (" << shard->drain_lost << " sends failed), spooled " << spooled
+                                    << ", dropped " << left << " at the deadline";
+
+            std::uint64_t dropped = shard->dropped.load(std::memory_order_relaxed);
+            if (dropped != 0) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Shard " << shard->index << " dropped " << dropped << " packets on a full queue";
+            }
+        }
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "Stopped in " << (monotonic_ns() - started_ns) / 1000000 << " ms";
+
+        // The resolver may be needed until the drain is over.
+        if (resolver.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(resolver_mutex);
+                resolver_stop = true;
+            }
+            resolver_cv.notify_all();
+            resolver.join();
+        }
+
+        reclaim_retired(true);
+
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        journal.close();
+
         return PLUGIN_SUCCESS;
     }
 
@@ -384,130 +929,2646 @@ public:
     // Service Functions
     // ********************************
 
-    // send_packet()
-    // Send a UDP packet to the desingated host.
-    int send_packet(Packet packet)
+    // send_unit()
+    //   Filter, build and send one unit event. The filters run first, so a rejected event never reaches
+    //   the alias lookup or the clock.
+    int send_unit(const UdpConfig& cfg, System* sys, Type typ, long source_id, long talkgroup_num)
+    {
+        if (!cfg.radios.pass(static_cast<u32>(source_id)) ||
+            (type_has_talkgroup(typ) && !cfg.talkgroups.pass(static_cast<u32>(talkgroup_num)))) {
+            return PLUGIN_SUCCESS;
+        }
+
+        Packet pkt{};
+        pkt.typ     = typ;
+        pkt.p25Id   = make_p25id(sys->get_sys_site_id(), sys->get_wacn());
+        pkt.nac     = p25_nac(sys->get_nac());
+        pkt.tgId    = static_cast<u16>(talkgroup_num);
+        pkt.radioId = static_cast<u32>(source_id);
+        stringToChar12(sys->find_unit_tag(source_id), pkt.alias);
+        pkt.ts      = time(NULL);
+
+        return enqueue(sys, pkt, (cfg.high_types >> typ) & 1);
+    }
+
+    // shard_of()
+    //   The shard a system number is sent from.
+    unsigned shard_of(std::size_t sys_num) const
+    {
+        return sys_num < system_shard.size() ? system_shard[sys_num] : static_cast<unsigned>(sys_num % shards.size());
+    }
+
+    // enqueue()
+    //   Hand a packet to the sender thread of its system's shard, on the high-priority queue if `high`. Never
+    //   blocks: a full queue drops the packet.
+    int enqueue(System* sys, const Packet& pkt, bool high)
     {
-        if (udp_socket.sock == INVALID_SOCKET || udp_socket.addrlen == 0) {
+        if (shards.empty()) {
             BOOST_LOG_TRIVIAL(error) << log_prefix << "UDP socket not initialized";
 
             return PLUGIN_FAILED;
         }
 
-        // Don't send duplicate packets.
-        if (last_packet == packet) {
-            return PLUGIN_SUCCESS;
+        std::size_t sys_num = static_cast<std::size_t>(sys->get_sys_num());
+        Shard& shard = *shards[shard_of(sys_num)];
+        if (!(high ? shard.high : shard.queue).push(QueuedPacket{pkt, static_cast<u16>(sys_num)})) {
+            shard.dropped.fetch_add(1, std::memory_order_relaxed);
+
+            return PLUGIN_FAILURE;
         }
 
-        std::vector<u8> data;
-        data.resize(sizeof(Packet));
-        std::memcpy(data.data(), &packet, sizeof(packet));
+        wake(shard, false, high);
+        return PLUGIN_SUCCESS;
+    }
 
-        ssize_t bytesSent = ::sendto(
-            udp_socket.sock,
-            data.data(),
-            data.size(),
-            0,
-            reinterpret_cast<const sockaddr*>(&udp_socket.addr),
-            udp_socket.addrlen
-        );
+    // wake()
+    //   Wake a shard's sender thread if it is asleep, or if `urgent` and it is lingering. The fence pairs with the
+    //   ones in sender_sleep() and linger(): either the sender sees the new packet before waiting, or we see it
+    //   waiting. A busy sender costs no syscall.
+    void wake(Shard& shard, bool always, bool urgent = false)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (always || shard.sleeping.load(std::memory_order_relaxed) ||
+            (urgent && shard.lingering.load(std::memory_order_relaxed))) {
+            std::uint64_t one = 1;
+            ssize_t rc = ::write(shard.wake_fd, &one, sizeof(one));
+            (void)rc;
+        }
+    }
 
-        // Update the last packet, to this packet.
-        last_packet = packet;
+    // ********************************
+    // Sender threads
+    // ********************************
 
-        if (bytesSent == -1) {
-            int err = errno;
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "sendto failed (" << err << "): " << std::strerror(err);
+    // sender_loop()
+    //   Sender thread of one shard: drain the queue in batches and send every batch to each destination.
+    void sender_loop(Shard& shard)
+    {
+        std::string name = "status_udp/" + std::to_string(shard.index);
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+        if (shard.cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(shard.cpu, &cpus);
+            int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (rc != 0) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot pin shard " << shard.index << " to CPU " << shard.cpu << ": " << std::strerror(rc);
+            }
+        }
 
-            return PLUGIN_FAILURE;
+        for (;;) {
+            // The snapshot is held for one pass, and let go before sleeping so an idle shard never holds up
+            // reclaiming it.
+            ReadSection section(config_readers);
+            const UdpConfig* cfg = config.load(std::memory_order_acquire);
+            if (shard.generation != cfg->generation ||
+                shard.resolve_generation != resolve_generation.load(std::memory_order_acquire)) {
+                update_links(shard, *cfg);
+            }
+            std::uint64_t now = monotonic_ns();
+            maintain_links(shard, *cfg, now);
+            run_commands(shard, *cfg, now);
+            expire_units(shard, *cfg);
+            send_rosters(shard, *cfg, now);
+            if (!state_file.empty() && state_interval_s != 0 && cfg->track_units() && now >= shard.next_state_save) {
+                if (shard.next_state_save != 0) {
+                    save_units(shard);
+                }
+                shard.next_state_save = now + 1000000000ull * state_interval_s;
+            }
+            if (cfg->snapshots && cfg->snapshot_interval_s != 0 && now >= shard.next_snapshot) {
+                if (shard.next_snapshot != 0) {
+                    start_snapshot(shard, *cfg, nullptr);
+                }
+                shard.next_snapshot = now + 1000000000ull * cfg->snapshot_interval_s;
+            }
+            report_errors(shard, now);
+
+            // Draining for stop(): keep going until the queue is empty or the deadline passes.
+            bool stopping = shard.stopping.load(std::memory_order_acquire);
+            if (stopping && (now >= shard.drain_deadline || (shard.idle() && links_flushed(shard)))) {
+                break;
+            }
+
+            // Nothing to send to yet: leave events queued until the resolver or a reopen makes a link ready,
+            // or until the queue fills past the spool threshold and they are better off on disk.
+            bool ready = links_ready(shard);
+            if (!ready && !spill_due(shard, *cfg, stopping)) {
+                section.leave();
+                sender_sleep(shard);
+                continue;
+            }
+
+            shard.batch.clear();
+            shard.batch_systems.clear();
+            shard.batch_high = 0;
+            bool urgent = fill_batch(shard, *cfg, stopping);
+            if (ready && !stopping && !urgent && !shard.batch.empty() && shard.batch.size() < cfg->batch_max && cfg->linger_us != 0) {
+                // Give a burst a moment to fill the batch; one sendmmsg() beats several.
+                linger(shard, cfg->linger_us);
+                fill_batch(shard, *cfg, stopping);
+            }
+
+            if (!shard.batch.empty()) {
+                if (stopping) {
+                    shard.drained += shard.batch.size();
+                }
+                send_batch(shard, *cfg);
+            }
+            release_held(shard, *cfg, monotonic_ns());
+
+            // Backlog and snapshots go out only after live traffic, and no faster than their rates.
+            bool replaying = !stopping && replay_spools(shard, *cfg, monotonic_ns());
+            if (!stopping && send_snapshots(shard, *cfg, monotonic_ns())) {
+                replaying = true;
+            }
+            if (shard.batch.empty() && !replaying) {
+                section.leave();
+                sender_sleep(shard);
+            }
         }
+    }
 
-        return PLUGIN_SUCCESS;
+    // spill_due()
+    //   With no destination up, whether queued packets should be moved to the spools now: once the queue passes
+    //   spool_threshold, or straight away while stopping so nothing is left behind at the deadline.
+    bool spill_due(const Shard& shard, const UdpConfig& cfg, bool stopping) const
+    {
+        if (cfg.spool_dir.empty() || shard.queues_empty()) {
+            return false;
+        }
+        return stopping || static_cast<double>(shard.queue.size()) >= cfg.spool_threshold * static_cast<double>(shard.queue.capacity());
     }
 
-    void open_udp_connection()
+    // fill_batch()
+    //   Top the batch up to batch_max, high-priority packets first: they go ahead of any bulk packets already in
+    //   it, so they lead the first frame. Then packets made from unit state, coalesced packets whose interval is
+    //   up, and bulk packets; those of a coalesced type are held back instead. Returns true if the batch holds a
+    //   high-priority packet.
+    bool fill_batch(Shard& shard, const UdpConfig& cfg, bool stopping)
     {
-        this->udp_socket = make_udp_target(udp_dest);
-        if (this->udp_socket.sock == INVALID_SOCKET) {
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "Failed to open UDP target for " << udp_dest;
+        std::size_t batch_max = cfg.batch_max;
+        QueuedPacket queued;
+        while (shard.batch.size() < batch_max && shard.high.pop(queued)) {
+            shard.batch.insert(shard.batch.begin() + static_cast<std::ptrdiff_t>(shard.batch_high), queued.pkt);
+            shard.batch_systems.insert(shard.batch_systems.begin() + static_cast<std::ptrdiff_t>(shard.batch_high), queued.sys_num);
+            ++shard.batch_high;
+        }
+
+        while (shard.batch.size() < batch_max && !shard.generated.empty()) {
+            shard.batch.push_back(shard.generated.front().pkt);
+            shard.batch_systems.push_back(shard.generated.front().sys_num);
+            shard.generated.pop_front();
+        }
+
+        std::uint64_t now = monotonic_ns();
+        if (!shard.coalescing.empty() && shard.flushing.empty() && (now >= shard.flush_at || stopping)) {
+            shard.flushing.swap(shard.coalescing);
+            shard.coalesce_index.clear();
+        }
+        while (shard.batch.size() < batch_max && shard.flushed < shard.flushing.size()) {
+            shard.batch.push_back(shard.flushing[shard.flushed].pkt);
+            shard.batch_systems.push_back(shard.flushing[shard.flushed++].sys_num);
         }
+        if (shard.flushed == shard.flushing.size()) {
+            shard.flushing.clear();
+            shard.flushed = 0;
+        }
+
+        while (shard.batch.size() < batch_max && shard.queue.pop(queued)) {
+            if ((cfg.coalesce_types >> (queued.pkt.typ & 0x0F)) & 1) {
+                coalesce(shard, cfg, queued, now);
+                continue;
+            }
+            shard.batch.push_back(queued.pkt);
+            shard.batch_systems.push_back(queued.sys_num);
+        }
+        return shard.batch_high != 0;
     }
 
-    // Parse udp://host[:port], with default port 7727
-    bool parse_udp_uri(const std::string& uri, std::string& host, std::string& port) {
-        const std::string prefix = "udp://";
-        if (uri.rfind(prefix, 0) != 0) {
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "Destination URI must start with udp://" << endl;
+    // coalesce()
+    //   Hold a packet until the next flush, replacing the one held for the same radio and type, if any. The first
+    //   packet held starts the interval.
+    void coalesce(Shard& shard, const UdpConfig& cfg, const QueuedPacket& queued, std::uint64_t now)
+    {
+        RadioKey key{queued.pkt.p25Id, queued.pkt.radioId, static_cast<u8>(queued.pkt.typ)};
+        auto it = shard.coalesce_index.find(key);
+        if (it != shard.coalesce_index.end()) {
+            shard.coalescing[it->second] = queued;
+            ++shard.coalesced;
+            return;
+        }
+        if (shard.coalescing.empty()) {
+            shard.flush_at = now + 1000000ull * cfg.coalesce_ms;
+        }
+        shard.coalesce_index.emplace(key, shard.coalescing.size());
+        shard.coalescing.push_back(queued);
+    }
 
-            return false;
+    // linger()
+    //   Wait up to linger_us for more packets, or until a high-priority one arrives and must go at once.
+    void linger(Shard& shard, unsigned linger_us)
+    {
+        std::uint64_t count;
+        ssize_t rc = ::read(shard.wake_fd, &count, sizeof(count));     // Forget earlier wakes.
+        (void)rc;
+
+        shard.lingering.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (shard.high.empty()) {
+            pollfd pfd{shard.wake_fd, POLLIN, 0};
+            timespec timeout{static_cast<time_t>(linger_us / 1000000), static_cast<long>(linger_us % 1000000) * 1000};
+            ::ppoll(&pfd, 1, &timeout, nullptr);
         }
+        shard.lingering.store(false, std::memory_order_relaxed);
+    }
 
-        auto without_scheme = uri.substr(prefix.size());
-        auto colon = without_scheme.find_last_of(':');
+    // sender_sleep()
+    //   Block until a producer wakes us, or a tcp:// socket that is connecting or has buffered bytes becomes
+    //   writable. The timeout lets an idle shard still pick up configuration changes, and is shortened so a link
+    //   in backoff is reopened on time.
+    void sender_sleep(Shard& shard)
+    {
+        int timeout_ms = 1000;
+        std::uint64_t now = monotonic_ns();
+        for (const auto& link : shard.links) {
+            if (link->connecting) {
+                // Woken by POLLOUT when the connect() completes; otherwise up to its deadline.
+                std::uint64_t wait_ms = link->connect_deadline > now ? (link->connect_deadline - now) / 1000000 + 1 : 0;
+                timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+            } else if (!link->ready() && (link->target.addrlen != 0 || link->is_shm())) {
+                std::uint64_t wait_ms = link->retry_at > now ? (link->retry_at - now) / 1000000 + 1 : 0;
+                timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+            } else if (link->ready() && !link->spool.empty()) {
+                // Wake for the next catch-up token.
+                std::uint64_t wait_ms = (link->catchup.wait_ns(now) + 999999) / 1000000;
+                timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+            }
+            if (link->ready() && !link->snapshot.empty()) {
+                std::uint64_t wait_ms = (link->snapshot_pace.wait_ns(now) + 999999) / 1000000;
+                timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+            }
+            if (!link->held.empty() && link->ready()) {
+                // Wake for the next rate limit token; type buckets are checked at least every millisecond.
+                std::uint64_t wait_ms = std::max<std::uint64_t>(1, (link->limit.wait_ns(now) + 999999) / 1000000);
+                timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+            }
+        }
 
-        if (colon == std::string::npos) {
-            host = without_scheme;
-            port = "7767";  // default
-        } else {
-            host = without_scheme.substr(0, colon);
-            port = without_scheme.substr(colon + 1);
-            if (port.empty()) port = "7767"; // handle udp://host:
+        if (!shard.coalescing.empty()) {
+            std::uint64_t wait_ms = shard.flush_at > now ? (shard.flush_at - now) / 1000000 + 1 : 0;
+            timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
+        }
+
+        if (shard.stopping.load(std::memory_order_acquire)) {
+            std::uint64_t wait_ms = shard.drain_deadline > now ? (shard.drain_deadline - now) / 1000000 + 1 : 0;
+            timeout_ms = std::min<int>(timeout_ms, static_cast<int>(wait_ms));
         }
 
-        BOOST_LOG_TRIVIAL(info) << log_prefix << "parse_udp_uri: host: '" << host << "' port: '" << port << "'" << endl;
+        shard.sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-        return !host.empty();
+        if (shard.queues_empty() || !links_ready(shard)) {
+            shard.pollfds.assign(1, pollfd{shard.wake_fd, POLLIN, 0});
+            for (const auto& link : shard.links) {
+                if (link->target.sock != INVALID_SOCKET && (link->connecting || !link->outbuf.empty())) {
+                    shard.pollfds.push_back(pollfd{link->target.sock, POLLOUT, 0});
+                }
+            }
+            ::poll(shard.pollfds.data(), shard.pollfds.size(), timeout_ms);
+        }
+
+        shard.sleeping.store(false, std::memory_order_relaxed);
+        std::uint64_t count;
+        ssize_t rc = ::read(shard.wake_fd, &count, sizeof(count));
+        (void)rc;
     }
 
-    UdpTarget make_udp_target(const std::string& uri) {
-        UdpTarget target{};
-        target.sock = INVALID_SOCKET;
+    // send_batch()
+    //   Drop duplicates, journal, and send what is left to every destination with one sendmmsg() each. A
+    //   destination with routing rules gets only the packets routed to it.
+    void send_batch(Shard& shard, const UdpConfig& cfg)
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < shard.batch.size(); ++i) {
+            const Packet pkt = shard.batch[i];
+            // Don't send duplicate packets. Roster packets keep radio ids where Packet has the alias, which
+            // operator== compares as a string.
+            if (shard.last_packet == pkt && base_type(pkt.typ) != Type::Group_Roster) {
+                continue;
+            }
+            // Update the last packet, to this packet.
+            shard.last_packet = pkt;
+            shard.batch_systems[n] = shard.batch_systems[i];
+            shard.batch[n++] = pkt;
+        }
+        shard.batch.resize(n);
+        shard.batch_systems.resize(n);
+        if (n == 0) {
+            return;
+        }
 
-        std::string host, port;
-        if (!parse_udp_uri(uri, host, port)) {
-            BOOST_LOG_TRIVIAL(error) << "Invalid URI format";
-            return target;
+        if (cfg.track_units()) {
+            for (std::size_t i = 0; i < n; ++i) {
+                // Unit events only, not the packets the plugin makes from the table itself; those are flagged or of
+                // a type past Unit_PTTP.
+                if (shard.batch[i].typ <= Type::Unit_PTTP) {
+                    shard.units.update(shard.batch[i], shard.batch_systems[i], cfg.unit_timeout_s);
+                }
+            }
         }
 
-        if (host == "0.0.0.0" || host == "::") {
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "Refusing to use unspecified address (" << host << ") as a destination";
-            return target;
+        if (journal.is_open()) {
+            // Stamped under the lock, so records from different shards stay in time order.
+            std::lock_guard<std::mutex> lock(journal_mutex);
+            std::uint64_t now = realtime_ns();
+            for (const Packet& pkt : shard.batch) {
+                journal.write(now, &pkt, static_cast<u16>(sizeof(pkt)));
+            }
         }
 
-        addrinfo hints{};
-        hints.ai_family   = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_flags    = AI_NUMERICSERV;
+        if (cfg.routed) {
+            shard.batch_routes.resize(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                shard.batch_routes[i] = cfg.route_mask(shard.batch_systems[i], shard.batch[i]);
+            }
+        }
 
-        addrinfo* res = nullptr;
-        int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
-        if (rc != 0) {
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "getaddrinfo failed for " << host << ":" << port
-                                     << " (" << gai_strerror(rc) << ")";
-            return target;
+        std::uint64_t now = monotonic_ns();
+        for (std::size_t d = 0; d < shard.links.size(); ++d) {
+            auto& link = shard.links[d];
+            std::vector<Packet>& routed = cfg.routed ? route_batch(shard, d) : shard.batch;
+            if (routed.empty()) {
+                continue;
+            }
+            if (!link->ready()) {
+                link_unready(shard, *link, routed.data(), routed.size(), now);
+                continue;
+            }
+            send_packets(shard, *link, cfg, link->limited ? rate_limit(shard, *link, cfg, routed, now) : routed, now);
         }
+    }
 
-        target.sock = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (target.sock == INVALID_SOCKET) {
-            BOOST_LOG_TRIVIAL(error) << log_prefix << "socket() failed";
-            ::freeaddrinfo(res);
-            return target;
+    // expire_units()
+    //   Run the unit timers up to the current second. A radio whose timer runs out is forgotten and, if its
+    //   system sends Unit_Off, gets one flagged TYPE_INFERRED.
+    void expire_units(Shard& shard, const UdpConfig& cfg)
+    {
+        u32 now = static_cast<u32>(time(NULL));
+        if (now == shard.units_time || shard.units.empty()) {
+            shard.units_time = now;
+            return;
+        }
+        shard.units_time = now;
+        shard.units.expire(now, [&](const UnitState& u) {
+            if (!cfg.type_enabled(u.sys_num, Type::Unit_Off)) {
+                return;
+            }
+            QueuedPacket queued;
+            queued.pkt.typ = static_cast<Type>(Type::Unit_Off | TYPE_INFERRED);
+            queued.pkt.p25Id = u.p25Id;
+            queued.pkt.nac = u.nac;
+            queued.pkt.radioId = u.radioId;
+            std::memcpy(queued.pkt.alias, u.alias, sizeof(queued.pkt.alias));
+            queued.pkt.ts = now;
+            queued.sys_num = u.sys_num;
+            shard.generated.push_back(queued);
+            ++shard.inferred_off;
+        });
+    }
+
+    // send_rosters()
+    //   Every roster_interval_s, queue the roster of every talkgroup with members, and an empty one for each
+    //   talkgroup whose last member left since the previous round.
+    void send_rosters(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        if (cfg.roster_interval_s == 0 || now < shard.next_roster) {
+            return;
         }
+        shard.next_roster = now + 1000000000ull * cfg.roster_interval_s;
+
+        auto queue_roster = [&](const TalkgroupMembers& group) {
+            RosterPacket roster;
+            roster.p25Id = group.p25Id;
+            roster.nac = group.nac;
+            roster.tgId = group.tgId;
+            roster.total = static_cast<u16>(std::min<std::size_t>(group.radios.size(), 0xFFFF));
+            QueuedPacket queued;
+            queued.sys_num = group.sys_num;
+            std::size_t first = 0;
+            do {
+                roster.first = static_cast<u16>(first);
+                for (std::size_t k = 0; k < 4; ++k) {
+                    roster.radios[k] = first + k < roster.total ? group.radios[first + k] : 0;
+                }
+                std::memcpy(static_cast<void*>(&queued.pkt), &roster, sizeof(queued.pkt));
+                shard.generated.push_back(queued);
+                first += 4;
+            } while (first < roster.total);
+        };
+        shard.units.for_each_group(queue_roster);
+        shard.units.take_emptied(queue_roster);
+    }
 
-        std::memcpy(&target.addr, res->ai_addr, res->ai_addrlen);
-        target.addrlen = static_cast<socklen_t>(res->ai_addrlen);
+    // save_units()
+    //   Save a shard's unit table to its state file.
+    void save_units(const Shard& shard)
+    {
+        std::string path = state_file + "." + std::to_string(shard.index);
+        if (!shard.units.save(path, static_cast<u32>(time(NULL)))) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot save unit state to " << path << ": " << std::strerror(errno);
+        }
+    }
 
-        // Optional: enable broadcast if you're targeting a broadcast address
-        if (res->ai_family == AF_INET) {
-            auto sin = reinterpret_cast<const sockaddr_in*>(res->ai_addr);
-            if (sin->sin_addr.s_addr == INADDR_BROADCAST) {
-                int yes = 1;
-                ::setsockopt(target.sock, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+    // load_units()
+    //   Warm the unit tables from the state files of the last run, whatever its shard count: each radio goes to
+    //   the shard of its system, with its timer running from when it was last heard. Radios not heard from in
+    //   state_max_age_s are left out. Files of shards this run does not have are removed once read.
+    void load_units()
+    {
+        ReadSection section(config_readers);
+        const UdpConfig* cfg = config.load(std::memory_order_acquire);
+        if (state_file.empty() || !cfg->track_units()) {
+            return;
+        }
+        std::uint64_t now = static_cast<std::uint64_t>(time(NULL));
+        std::size_t restored = 0;
+        std::size_t stale = 0;
+        std::vector<UnitState> saved;
+        for (unsigned k = 0; ; ++k) {
+            std::string path = state_file + "." + std::to_string(k);
+            u32 saved_at = 0;
+            if (!UnitTable::read(path, saved, saved_at)) {
+                int err = errno;
+                if (err == ENOENT) {
+                    break;
+                }
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot read unit state from " << path << ": " << std::strerror(err);
+                if (err != EINVAL) {
+                    break;
+                }
+                continue;
+            }
+            for (const UnitState& u : saved) {
+                if (!u.in_use || static_cast<std::uint64_t>(u.last_seen) + state_max_age_s < now) {
+                    ++stale;
+                    continue;
+                }
+                shards[shard_of(u.sys_num)]->units.restore(u, cfg->unit_timeout_s);
+                ++restored;
             }
+            if (k >= shards.size()) {
+                ::unlink(path.c_str());
+            }
+        }
+        if (restored != 0 || stale != 0) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "Restored " << restored << " radios from " << state_file << " ("
+                                    << stale << " not heard from in " << state_max_age_s << "s left out)";
         }
+    }
 
-        ::freeaddrinfo(res);
-        return target;
+    // send_packets()
+    //   Send pkts to a link that is up, by whichever transport it uses.
+    void send_packets(Shard& shard, Link& link, const UdpConfig& cfg, std::vector<Packet>& pkts, std::uint64_t now)
+    {
+        std::size_t count = pkts.size();
+        if (count == 0) {
+            return;
+        }
+        std::size_t per_frame = cfg.framing_v2 ? cfg.frame_packets : 1;
+        std::size_t frames = encode_frames(shard, link, cfg, pkts);
+        if (link.is_shm()) {
+            write_ring(shard, link, frames, now);
+            return;
+        }
+        if (link.is_stream()) {
+            send_stream(shard, link, cfg, pkts, frames, now);
+            return;
+        }
+
+        std::size_t sent = 0;
+        while (sent < frames) {
+            int rc = ::sendmmsg(link.target.sock, &shard.msgs[sent], static_cast<unsigned>(frames - sent), MSG_NOSIGNAL);
+            if (rc == -1) {
+                int err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                link_failed(link, cfg, "sendto", err, now);
+                link_unready(shard, link, &pkts[sent * per_frame], count - sent * per_frame, now);
+                // Unsent frames give their sequence numbers back, so the receiver sees no false gap.
+                link.seq -= static_cast<u32>(cfg.framing_v2 ? frames - sent : 0);
+                break;
+            }
+            sent += static_cast<std::size_t>(rc);
+            if (sent < frames && connected_datagram(link)) {
+                // sendmmsg() stops short at an error after the first message and drops it. On a connected
+                // socket that is the collector's ICMP error; take it as such, as the next send would.
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (::getsockopt(link.target.sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err == 0) {
+                    err = ECONNREFUSED;
+                }
+                link_failed(link, cfg, "sendto", err, now);
+                link_unready(shard, link, &pkts[sent * per_frame], count - sent * per_frame, now);
+                link.seq -= static_cast<u32>(cfg.framing_v2 ? frames - sent : 0);
+                break;
+            }
+        }
+        remember_frames(link, cfg, pkts, sent);
+        for (std::size_t f = 0; f < sent && cfg.framing_v2; ++f) {
+            if (link.fec.add(link.headers[f], &pkts[f * per_frame])) {
+                send_parity(link);
+            }
+        }
+        if (sent == frames) {
+            link_sent(link, now);
+        }
+    }
+
+    // rate_limit()
+    //   The packets of pkts a rate-limited link may have now, in shard.limited. Each takes a token from the
+    //   bucket of its type and from the destination's; the rest are dropped, or held with overflow "coalesce".
+    std::vector<Packet>& rate_limit(Shard& shard, Link& link, const UdpConfig& cfg, const std::vector<Packet>& pkts, std::uint64_t now)
+    {
+        shard.limited.clear();
+        for (const Packet& pkt : pkts) {
+            if (!take_token(link, cfg, pkt, now)) {
+                hold(link, pkt);
+                continue;
+            }
+            // A held packet is stale once a newer one of its radio and type goes out.
+            if (!link.held.empty() && link.held.erase(held_key(pkt)) != 0) {
+                ++link.coalesced;
+            }
+            shard.limited.push_back(pkt);
+        }
+        return shard.limited;
+    }
+
+    // take_token()
+    //   Take a packet's tokens if both its buckets have them. Bulk packets leave the destination's reserve to
+    //   high-priority ones, so when the limit bites bulk traffic is what goes first.
+    bool take_token(Link& link, const UdpConfig& cfg, const Packet& pkt, std::uint64_t now)
+    {
+        TokenBucket& type = link.type_limits[pkt.typ & 0x0F];
+        bool high = (cfg.high_types >> (pkt.typ & 0x0F)) & 1;
+        if (type.wait_ns(now) != 0 || link.limit.wait_ns(now, high ? 1 : 1 + link.limit_settings.reserve) != 0) {
+            return false;
+        }
+        type.take(now);
+        link.limit.take(now);
+        return true;
+    }
+
+    // hold()
+    //   A packet over a link's limit: with overflow "coalesce" keep it, replacing the held packet it supersedes
+    //   (see held_key()), up to HELD_MAX; otherwise drop it.
+    void hold(Link& link, const Packet& pkt)
+    {
+        if (!link.coalesce) {
+            ++link.throttled;
+            return;
+        }
+        auto key = held_key(pkt);
+        auto it = link.held.find(key);
+        if (it != link.held.end()) {
+            it->second = pkt;
+            ++link.coalesced;
+        } else if (link.held.size() < HELD_MAX) {
+            link.held.emplace(key, pkt);
+        } else {
+            ++link.throttled;
+        }
+    }
+
+    // held_key()
+    //   What replaces a held packet: a newer one of the same system, radio and type, or for a roster packet the
+    //   same part of the same talkgroup's roster.
+    static std::tuple<u32, u32, u8> held_key(const Packet& pkt)
+    {
+        u32 id = pkt.radioId;
+        if (base_type(pkt.typ) == Type::Group_Roster) {
+            RosterPacket roster;
+            std::memcpy(static_cast<void*>(&roster), static_cast<const void*>(&pkt), sizeof(roster));
+            id = static_cast<u32>(roster.tgId) << 16 | roster.first;
+        }
+        return std::make_tuple(pkt.p25Id, id, static_cast<u8>(pkt.typ));
+    }
+
+    // release_held()
+    //   Send held packets to links that are up as their buckets refill.
+    void release_held(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        for (auto& link : shard.links) {
+            if (link->held.empty() || !link->ready()) {
+                continue;
+            }
+            shard.limited.clear();
+            for (auto it = link->held.begin(); it != link->held.end(); ) {
+                if (!take_token(*link, cfg, it->second, now)) {
+                    ++it;
+                    continue;
+                }
+                shard.limited.push_back(it->second);
+                it = link->held.erase(it);
+            }
+            send_packets(shard, *link, cfg, shard.limited, now);
+        }
+    }
+
+    // route_batch()
+    //   The packets of the batch routed to destination d: the batch itself if that is all of them, otherwise
+    //   a copy of the ones it takes in shard.routed.
+    std::vector<Packet>& route_batch(Shard& shard, std::size_t d)
+    {
+        shard.routed.clear();
+        for (std::size_t i = 0; i < shard.batch.size(); ++i) {
+            if (d < 64 && ((shard.batch_routes[i] >> d) & 1)) {
+                shard.routed.push_back(shard.batch[i]);
+            }
+        }
+        return shard.routed.size() == shard.batch.size() ? shard.batch : shard.routed;
+    }
+
+    // encode_frames()
+    //   Point shard.msgs at pkts for one link: a datagram per packet with legacy framing, or a FrameHeader
+    //   and up to frame_packets packets per datagram with v2. Packets are never copied. Returns the frame count.
+    std::size_t encode_frames(Shard& shard, Link& link, const UdpConfig& cfg, std::vector<Packet>& pkts)
+    {
+        std::size_t n = pkts.size();
+        std::size_t per_frame = cfg.framing_v2 ? cfg.frame_packets : 1;
+        std::size_t iov_per_frame = cfg.framing_v2 ? 2 : 1;
+        std::size_t frames = (n + per_frame - 1) / per_frame;
+
+        shard.iov.resize(frames * iov_per_frame);
+        shard.msgs.resize(frames);
+        link.headers.resize(cfg.framing_v2 ? frames : 0);
+        for (std::size_t f = 0; f < frames; ++f) {
+            std::size_t first = f * per_frame;
+            std::size_t count = std::min(per_frame, n - first);
+            iovec* iov = &shard.iov[f * iov_per_frame];
+            if (cfg.framing_v2) {
+                FrameHeader& hdr = link.headers[f];
+                hdr = FrameHeader{};
+                hdr.instance = instance;
+                hdr.stream   = static_cast<u16>(shard.index);
+                hdr.count    = static_cast<u16>(count);
+                hdr.seq      = link.seq++;
+                iov->iov_base = &hdr;
+                iov->iov_len  = sizeof(hdr);
+                ++iov;
+            }
+            iov->iov_base = &pkts[first];
+            iov->iov_len  = count * sizeof(Packet);
+
+            shard.msgs[f] = mmsghdr{};
+            shard.msgs[f].msg_hdr.msg_name    = &link.target.addr;
+            shard.msgs[f].msg_hdr.msg_namelen = link.target.addrlen;
+            shard.msgs[f].msg_hdr.msg_iov     = &shard.iov[f * iov_per_frame];
+            shard.msgs[f].msg_hdr.msg_iovlen  = iov_per_frame;
+        }
+        return frames;
+    }
+
+    // write_ring()
+    //   Append the frames encode_frames() built to a link's shared memory ring, then wake any reader asleep on it.
+    //   A frame too big for a slot is dropped; the ring never fails otherwise.
+    void write_ring(Shard& shard, Link& link, std::size_t frames, std::uint64_t now)
+    {
+        for (std::size_t f = 0; f < frames; ++f) {
+            const msghdr& msg = shard.msgs[f].msg_hdr;
+            if (!link.shm.write(msg.msg_iov, msg.msg_iovlen) && link.send_errors.record(now, EMSGSIZE)) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Frame larger than the " << link.shm.slot_bytes() << " byte slots of "
+                                         << link.dest << "; lower frame_bytes or raise slot_bytes";
+            }
+        }
+        link.shm.publish();
+    }
+
+    // send_stream()
+    //   Send the frames encode_frames() built down a tcp:// link, each behind its 16-bit big-endian length, with
+    //   as few sendmsg() calls as the iovec limit allows. What the socket will not take is buffered: the rest of
+    //   a partly sent frame always, whole frames while they fit in tcp_buffer. Frames that do not fit are handled
+    //   like those of a down link, so a stalled collector costs memory up to the bound and never blocks.
+    void send_stream(Shard& shard, Link& link, const UdpConfig& cfg, const std::vector<Packet>& pkts, std::size_t frames, std::uint64_t now)
+    {
+        shard.lengths.resize(frames);
+        shard.stream_iov.clear();
+        for (std::size_t f = 0; f < frames; ++f) {
+            const msghdr& msg = shard.msgs[f].msg_hdr;
+            std::size_t len = 0;
+            for (std::size_t i = 0; i < msg.msg_iovlen; ++i) {
+                len += msg.msg_iov[i].iov_len;
+            }
+            shard.lengths[f] = htons(static_cast<u16>(len));
+            shard.stream_iov.push_back(iovec{&shard.lengths[f], sizeof(u16)});
+            shard.stream_iov.insert(shard.stream_iov.end(), msg.msg_iov, msg.msg_iov + msg.msg_iovlen);
+        }
+
+        // Straight from the batch while nothing is buffered ahead of it.
+        std::size_t written = 0;
+        if (link.outbuf.empty()) {
+            std::size_t i = 0;
+            while (i < shard.stream_iov.size()) {
+                msghdr msg{};
+                msg.msg_iov    = &shard.stream_iov[i];
+                msg.msg_iovlen = std::min<std::size_t>(shard.stream_iov.size() - i, IOV_MAX);
+                ssize_t rc = ::sendmsg(link.target.sock, &msg, MSG_NOSIGNAL);
+                if (rc == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    link_failed(link, cfg, "send", errno, now);
+                    // Frames written whole are gone; from the first cut off or unsent one on, they go to the spool.
+                    std::size_t per_frame = cfg.framing_v2 ? cfg.frame_packets : 1;
+                    std::size_t f = 0;
+                    for (std::size_t end = 0; f < frames; ++f) {
+                        end += sizeof(u16) + ntohs(shard.lengths[f]);
+                        if (end > written) {
+                            break;
+                        }
+                    }
+                    std::size_t first = std::min(f * per_frame, pkts.size());
+                    link_unready(shard, link, pkts.data() + first, pkts.size() - first, now);
+                    // As for datagrams, unsent frames give their sequence numbers back.
+                    link.seq -= static_cast<u32>(cfg.framing_v2 ? frames - f : 0);
+                    return;
+                }
+                written += static_cast<std::size_t>(rc);
+                std::size_t sent = static_cast<std::size_t>(rc);
+                while (i < shard.stream_iov.size() && sent >= shard.stream_iov[i].iov_len) {
+                    sent -= shard.stream_iov[i++].iov_len;
+                }
+                if (sent != 0) {
+                    break;                  // Partial: the socket is full.
+                }
+            }
+        }
+
+        std::size_t per_frame = cfg.framing_v2 ? cfg.frame_packets : 1;
+        std::size_t offset = 0;
+        const iovec* iov = shard.stream_iov.data();
+        for (std::size_t f = 0; f < frames; ++f) {
+            std::size_t iovcnt = 1 + shard.msgs[f].msg_hdr.msg_iovlen;
+            std::size_t len = sizeof(u16) + ntohs(shard.lengths[f]);
+            std::size_t skip = written > offset ? std::min(written - offset, len) : 0;
+            if (skip == 0 && link.outbuf.size() + len > link.options.tcp_buffer) {
+                // This frame and every one after it, so the stream stays in order; their sequence numbers go back.
+                std::size_t first = std::min(f * per_frame, pkts.size());
+                link_unready(shard, link, pkts.data() + first, pkts.size() - first, now);
+                link.seq -= static_cast<u32>(cfg.framing_v2 ? frames - f : 0);
+                break;
+            }
+            if (skip < len) {
+                buffer_frame(link, iov, iovcnt, skip);
+            }
+            offset += len;
+            iov += iovcnt;
+        }
+        link_sent(link, now);
+    }
+
+    // buffer_frame()
+    //   Append a tcp:// frame, gathered from iov, to the link's outbound buffer, less the first `skip` bytes
+    //   already sent.
+    static void buffer_frame(Link& link, const iovec* iov, std::size_t iovcnt, std::size_t skip)
+    {
+        for (std::size_t i = 0; i < iovcnt; ++i) {
+            std::size_t n = std::min(skip, iov[i].iov_len);
+            skip -= n;
+            link.outbuf.append(static_cast<const char*>(iov[i].iov_base) + n, iov[i].iov_len - n);
+        }
+    }
+
+    // flush_stream()
+    //   Send as much of a tcp:// link's outbound buffer as the socket takes.
+    void flush_stream(Link& link, const UdpConfig& cfg, std::uint64_t now)
+    {
+        std::size_t sent = 0;
+        while (sent < link.outbuf.size()) {
+            ssize_t rc = ::send(link.target.sock, link.outbuf.data() + sent, link.outbuf.size() - sent, MSG_NOSIGNAL);
+            if (rc == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    link_failed(link, cfg, "send", errno, now);
+                    return;
+                }
+                break;
+            }
+            sent += static_cast<std::size_t>(rc);
+        }
+        link.outbuf.erase(0, sent);
+    }
+
+    // finish_connect()
+    //   Check on a tcp:// link's non-blocking connect(), failing it once connect_timeout_ms has passed; a SYN that
+    //   is never answered would otherwise keep the link connecting for as long as the kernel retries.
+    void finish_connect(Link& link, const UdpConfig& cfg, std::uint64_t now)
+    {
+        pollfd pfd{link.target.sock, POLLOUT, 0};
+        if (::poll(&pfd, 1, 0) <= 0) {
+            if (now >= link.connect_deadline) {
+                link_failed(link, cfg, "connect", ETIMEDOUT, now);
+            }
+            return;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (::getsockopt(link.target.sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            link_failed(link, cfg, "connect", err, now);
+            return;
+        }
+        link.connecting = false;
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "Connected to " << link.dest;
+    }
+
+    // links_flushed()
+    //   True once no link that is up has tcp:// bytes buffered or packets held by its rate limit; stop() waits
+    //   for this as well as the queue.
+    bool links_flushed(const Shard& shard) const
+    {
+        for (const auto& link : shard.links) {
+            if (link->ready() && (!link->outbuf.empty() || !link->held.empty())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // remember_frames()
+    //   Keep the first `frames` frames of pkts just sent to a link in its history if they hold a type worth resending.
+    void remember_frames(Link& link, const UdpConfig& cfg, const std::vector<Packet>& pkts, std::size_t frames)
+    {
+        if (link.history.empty() || !cfg.framing_v2) {
+            return;
+        }
+        for (std::size_t f = 0; f < frames; ++f) {
+            const Packet* first = &pkts[f * cfg.frame_packets];
+            const Packet* last = first + link.headers[f].count;
+            if (std::none_of(first, last, [&](const Packet& pkt) { return (cfg.nack_types >> (pkt.typ & 0x0F)) & 1; })) {
+                continue;
+            }
+            Link::HistoryFrame& slot = link.history[link.headers[f].seq % link.history.size()];
+            slot.valid = true;
+            slot.seq = link.headers[f].seq;
+            slot.pkts.assign(first, last);
+        }
+    }
+
+    // send_parity()
+    //   Send the parity frame of the group the link's encoder just completed. A lost parity frame only costs
+    //   the receiver its chance to repair that group, so failures are left to the next data send to notice.
+    void send_parity(Link& link)
+    {
+        iovec iov[3] = {
+            {const_cast<FrameHeader*>(&link.fec.header()), sizeof(FrameHeader)},
+            {const_cast<ParityInfo*>(&link.fec.parity_info()), sizeof(ParityInfo)},
+            {const_cast<void*>(link.fec.data()), link.fec.data_len()},
+        };
+        msghdr msg{};
+        msg.msg_name    = &link.target.addr;
+        msg.msg_namelen = link.target.addrlen;
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = 3;
+        ssize_t rc = ::sendmsg(link.target.sock, &msg, MSG_NOSIGNAL);
+        (void)rc;
+    }
+
+    // run_commands()
+    //   Carry out what the control thread queued for this shard.
+    void run_commands(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        ShardCommand cmd;
+        while (shard.commands.pop(cmd)) {
+            u16 port = cmd.kind == ShardCommand::Snapshot ? cmd.port : cmd.nack.port;
+            for (auto& link_ptr : shard.links) {
+                Link& link = *link_ptr;
+                if (link.target.sock == INVALID_SOCKET || !same_host(link.target.addr, cmd.from) || target_port(link.target.addr) != port) {
+                    continue;
+                }
+                if (cmd.kind == ShardCommand::Snapshot) {
+                    if (cfg.snapshots) {
+                        start_snapshot(shard, cfg, &link);
+                    }
+                } else {
+                    resend_frames(shard, link, cfg, cmd.nack, now);
+                }
+            }
+        }
+    }
+
+    // start_snapshot()
+    //   Copy the unit table into a snapshot for one link, or for every link if `only` is null, to be streamed by
+    //   send_snapshots(). A link still streaming an older snapshot starts over with this one.
+    void start_snapshot(Shard& shard, const UdpConfig& cfg, const Link* only)
+    {
+        std::vector<QueuedPacket> radios;
+        radios.reserve(shard.units.size());
+        shard.units.for_each([&](const UnitState& u) {
+            QueuedPacket queued;
+            queued.pkt.typ = static_cast<Type>(u.last_typ | TYPE_SNAPSHOT);
+            queued.pkt.p25Id = u.p25Id;
+            queued.pkt.nac = u.nac;
+            queued.pkt.tgId = u.tgId;
+            queued.pkt.radioId = u.radioId;
+            std::memcpy(queued.pkt.alias, u.alias, sizeof(queued.pkt.alias));
+            queued.pkt.ts = u.last_seen;
+            queued.sys_num = u.sys_num;
+            radios.push_back(queued);
+        });
+
+        Packet marker{};
+        marker.nac = static_cast<u16>(shard.index);
+        marker.tgId = ++shard.snapshot_id;
+        marker.ts = static_cast<u32>(time(NULL));
+        for (std::size_t d = 0; d < shard.links.size(); ++d) {
+            Link& link = *shard.links[d];
+            if (only != nullptr && &link != only) {
+                continue;
+            }
+            link.snapshot.clear();
+            link.snapshot.push_back(marker);
+            for (const QueuedPacket& queued : radios) {
+                if (!cfg.routed || cfg.routes_to(cfg.route_mask(queued.sys_num, queued.pkt), d)) {
+                    link.snapshot.push_back(queued.pkt);
+                }
+            }
+            link.snapshot.push_back(marker);
+            link.snapshot.front().typ = Type::Snapshot_Begin;
+            link.snapshot.back().typ = Type::Snapshot_End;
+            link.snapshot.front().radioId = link.snapshot.back().radioId = static_cast<u32>(link.snapshot.size() - 2);
+            link.snapshot_sent = 0;
+            link.snapshot_pace = TokenBucket(cfg.snapshot_rate, static_cast<double>(cfg.batch_max));
+        }
+    }
+
+    // send_snapshots()
+    //   Stream snapshots to the links that are up, one packet per token and at most a batch per call so live
+    //   traffic is never kept waiting. Returns true if more could be sent straight away.
+    bool send_snapshots(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        bool pending = false;
+        for (auto& link : shard.links) {
+            if (link->snapshot.empty() || !link->ready()) {
+                continue;
+            }
+            std::size_t n = 0;
+            std::size_t left = link->snapshot.size() - link->snapshot_sent;
+            while (n < cfg.batch_max && n < left && link->snapshot_pace.take(now)) {
+                ++n;
+            }
+            if (n == 0) {
+                continue;
+            }
+            auto first = link->snapshot.begin() + static_cast<std::ptrdiff_t>(link->snapshot_sent);
+            shard.limited.assign(first, first + static_cast<std::ptrdiff_t>(n));
+            send_packets(shard, *link, cfg, shard.limited, now);
+            link->snapshot_sent += n;
+            if (link->snapshot_sent == link->snapshot.size()) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Sent a snapshot of " << (link->snapshot.size() - 2) << " radios to " << link->dest
+                                        << " from shard " << shard.index;
+                link->snapshot.clear();
+                link->snapshot.shrink_to_fit();
+            }
+            pending = pending || (n == cfg.batch_max && !link->snapshot.empty());
+        }
+        return pending;
+    }
+
+    // resend_frames()
+    //   Answer a NackRequest from a link's history, flagged as retransmissions and within the resend rate.
+    void resend_frames(Shard& shard, Link& link, const UdpConfig& cfg, const NackRequest& nack, std::uint64_t now)
+    {
+        std::size_t count = std::min<std::size_t>(nack.count, link.history.size());
+        if (link.history.empty()) {
+            link.resend_missed += nack.count;
+            return;
+        }
+        link.resend_missed += nack.count - count;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            u32 seq = nack.first_seq + static_cast<u32>(i);
+            const Link::HistoryFrame& slot = link.history[seq % link.history.size()];
+            if (!slot.valid || slot.seq != seq) {
+                ++link.resend_missed;
+                continue;
+            }
+            if (!link.resend.take(now)) {
+                link.resend_throttled += count - i;
+                return;
+            }
+
+            FrameHeader hdr{};
+            hdr.flags    = FRAME_RETRANSMIT;
+            hdr.instance = instance;
+            hdr.stream   = static_cast<u16>(shard.index);
+            hdr.count    = static_cast<u16>(slot.pkts.size());
+            hdr.seq      = seq;
+            iovec iov[2] = {{&hdr, sizeof(hdr)}, {const_cast<Packet*>(slot.pkts.data()), slot.pkts.size() * sizeof(Packet)}};
+            msghdr msg{};
+            msg.msg_name    = &link.target.addr;
+            msg.msg_namelen = link.target.addrlen;
+            msg.msg_iov     = iov;
+            msg.msg_iovlen  = 2;
+            if (::sendmsg(link.target.sock, &msg, MSG_NOSIGNAL) == -1) {
+                link_failed(link, cfg, "sendto", errno, now);
+                return;
+            }
+            ++link.resent;
+        }
+    }
+
+    // link_failed()
+    //   A send or socket() failed: close the socket and schedule a reopen with exponential backoff. A tcp:// link
+    //   starts its next connection with an empty buffer, since a frame cut off mid-way cannot be resumed.
+    void link_failed(Link& link, const UdpConfig& cfg, const char* what, int err, std::uint64_t now)
+    {
+        if (link.send_errors.record(now, err)) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << what << " for " << link.dest << " failed (" << err << "): " << std::strerror(err)
+                                     << (link.outbuf.empty() ? "" : "; " + std::to_string(link.outbuf.size()) + " buffered bytes discarded");
+        }
+        link.connecting = false;
+        link.outbuf.clear();
+        link.sending_since = 0;
+
+        if (link.target.sock != INVALID_SOCKET) {
+            ::close(link.target.sock);
+            link.target.sock = INVALID_SOCKET;
+        }
+        std::uint64_t min_ns = 1000000ull * cfg.backoff_min_ms;
+        std::uint64_t max_ns = 1000000ull * cfg.backoff_max_ms;
+        link.backoff_ns = link.backoff_ns == 0 ? min_ns : std::min(max_ns, link.backoff_ns * 2);
+        link.retry_at = now + link.backoff_ns;
+    }
+
+    // link_sent()
+    //   Note a send that went through whole. A link that had failed recovers at once, except a connected
+    //   datagram link: its sends succeed until the collector's ICMP error comes back, so it must first go
+    //   RECOVERY_NS without one.
+    void link_sent(Link& link, std::uint64_t now)
+    {
+        if (link.sending_since == 0) {
+            link.sending_since = now;
+        }
+        if (link.backoff_ns == 0 || (connected_datagram(link) && now - link.sending_since < RECOVERY_NS)) {
+            return;
+        }
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "Destination " << link.dest << " recovered";
+        link.backoff_ns = 0;
+    }
+
+    // connected_datagram()
+    //   Whether a link sends on a connected udp:// socket, which reports the collector's ICMP errors.
+    static bool connected_datagram(const Link& link) {
+        return !link.is_shm() && link.options.socktype == SOCK_DGRAM && is_unicast(link.target.addr);
+    }
+
+    // link_unready()
+    //   Spool the packets a down link could not take, or count them as lost if it has no spool.
+    void link_unready(Shard& shard, Link& link, const Packet* pkts, std::size_t count, std::uint64_t now)
+    {
+        if (link.spool.is_open()) {
+            for (std::size_t i = 0; i < count; ++i) {
+                link.spool.push(&pkts[i], static_cast<u16>(sizeof(Packet)));
+            }
+            return;
+        }
+
+        if (shard.stopping.load(std::memory_order_relaxed)) {
+            shard.drain_lost += count;
+        }
+        if (count != 0 && link.unready.record(now, 0, count)) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Destination " << link.dest << " not ready; packet dropped";
+        }
+    }
+
+    // replay_spools()
+    //   Send spooled packets to the links that are up again, one per catch-up token and at most a batch per call
+    //   so live traffic is never kept waiting. Returns true if more could be sent straight away; otherwise
+    //   sender_sleep() waits for the next token.
+    bool replay_spools(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        bool pending = false;
+        for (auto& link : shard.links) {
+            if (!link->ready() || link->spool.empty()) {
+                continue;
+            }
+
+            const std::uint8_t* data;
+            std::uint16_t len;
+            std::size_t i = 0;
+            // A token is only spent on a record that actually went out.
+            for (; i < cfg.batch_max && link->spool.front(data, len) && link->catchup.wait_ns(now) == 0; ++i) {
+                FrameHeader hdr{};
+                hdr.instance = instance;
+                hdr.stream   = static_cast<u16>(shard.index);
+                hdr.count    = static_cast<u16>(len / sizeof(Packet));
+                hdr.seq      = link->seq;
+                iovec iov[2] = {{&hdr, sizeof(hdr)}, {const_cast<std::uint8_t*>(data), len}};
+                msghdr msg{};
+                msg.msg_name    = &link->target.addr;
+                msg.msg_namelen = link->target.addrlen;
+                msg.msg_iov     = cfg.framing_v2 ? iov : iov + 1;
+                msg.msg_iovlen  = cfg.framing_v2 ? 2 : 1;
+                if (link->is_shm()) {
+                    link->shm.write(msg.msg_iov, msg.msg_iovlen);
+                } else if (link->is_stream()) {
+                    // Behind whatever is buffered, and only while there is room.
+                    std::size_t frame_len = (cfg.framing_v2 ? sizeof(hdr) : 0) + len;
+                    if (link->outbuf.size() + sizeof(u16) + frame_len > link->options.tcp_buffer) {
+                        break;
+                    }
+                    u16 prefix = htons(static_cast<u16>(frame_len));
+                    iovec frame[3] = {{&prefix, sizeof(prefix)}, msg.msg_iov[0], msg.msg_iov[msg.msg_iovlen - 1]};
+                    buffer_frame(*link, frame, 1 + msg.msg_iovlen, 0);
+                } else if (::sendmsg(link->target.sock, &msg, MSG_NOSIGNAL) == -1) {
+                    if (errno != EINTR) {
+                        link_failed(*link, cfg, "sendto", errno, now);
+                    }
+                    break;
+                }
+                link->catchup.take(now);
+                link->spool.pop();
+                ++link->replayed;
+                if (cfg.framing_v2) {
+                    ++link->seq;
+                    if (link->fec.add(hdr, reinterpret_cast<const Packet*>(data))) {
+                        send_parity(*link);
+                    }
+                }
+            }
+
+            if (link->is_shm() && i != 0) {
+                link->shm.publish();
+            }
+            if (link->is_stream() && !link->outbuf.empty()) {
+                flush_stream(*link, cfg, now);
+            }
+            if (link->spool.empty() && link->replayed != 0) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Destination " << link->dest << " caught up: replayed " << link->replayed << " spooled packets";
+                link->replayed = 0;
+            }
+            pending = pending || (i == cfg.batch_max && link->ready() && !link->spool.empty());
+        }
+        return pending;
+    }
+
+    // maintain_links()
+    //   Reopen the sockets, or shared memory rings, of links whose backoff has expired, and move tcp:// links along:
+    //   finish connecting, and send what is buffered.
+    void maintain_links(Shard& shard, const UdpConfig& cfg, std::uint64_t now)
+    {
+        for (auto& link : shard.links) {
+            if (link->connecting) {
+                finish_connect(*link, cfg, now);
+            }
+            if (link->ready() && !link->outbuf.empty()) {
+                flush_stream(*link, cfg, now);
+            }
+            if (link->target.sock != INVALID_SOCKET || link->ready() || (link->target.addrlen == 0 && !link->is_shm()) || now < link->retry_at) {
+                continue;
+            }
+            if (link->is_shm()) {
+                open_ring(shard, *link, cfg, now);
+            } else if (!open_udp_socket(link->target, link->options)) {
+                link_failed(*link, cfg, "socket", errno, now);
+            } else {
+                link->connecting = link->is_stream();
+                link->connect_deadline = now + 1000000ull * cfg.connect_timeout_ms;
+            }
+        }
+    }
+
+    // open_ring()
+    //   Create or reattach a link's shared memory ring. Each shard is the single producer of its own ring, so with
+    //   more than one shard the name gets a "-<shard>" suffix.
+    void open_ring(const Shard& shard, Link& link, const UdpConfig& cfg, std::uint64_t now)
+    {
+        link.shm_name = "/" + link.options.shm_name;
+        if (shards.size() > 1) {
+            link.shm_name += "-" + std::to_string(shard.index);
+        }
+        if (!link.shm.open(link.shm_name, link.options.shm_slots, link.options.shm_slot_bytes, link.options.shm_mode, link.options.shm_group)) {
+            link_failed(link, cfg, "shm_open", errno, now);
+            return;
+        }
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "Writing " << link.dest << " to shared memory " << link.shm_name;
+    }
+
+    // report_errors()
+    //   Log the summaries of suppressed errors, at most one line per kind per window.
+    void report_errors(Shard& shard, std::uint64_t now)
+    {
+        std::uint64_t count;
+        int err;
+        for (auto& link : shard.links) {
+            if (link->send_errors.summary(now, count, err)) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << count << " sendto failures to " << link->dest << " in last "
+                                         << link->send_errors.window_s() << "s, last errno " << err << " (" << std::strerror(err) << ")";
+            }
+            if (link->spool.corrupt() != link->spool_corrupt_reported) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Spool for " << link->dest << " held a damaged record; its backlog was discarded";
+                link->spool_corrupt_reported = link->spool.corrupt();
+            }
+            if (link->unready.summary(now, count, err)) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << count << " packets dropped for " << link->dest << " in last "
+                                         << link->unready.window_s() << "s, destination not ready";
+            }
+        }
+
+        if (now >= shard.next_report) {
+            for (auto& link : shard.links) {
+                if (link->resent != 0 || link->resend_missed != 0 || link->resend_throttled != 0) {
+                    BOOST_LOG_TRIVIAL(info) << log_prefix << "Resent " << link->resent << " frames to " << link->dest << " in last 10s ("
+                                            << link->resend_missed << " no longer in history, " << link->resend_throttled << " over the rate limit)";
+                    link->resent = link->resend_missed = link->resend_throttled = 0;
+                }
+                if (link->throttled != 0 || link->coalesced != 0) {
+                    BOOST_LOG_TRIVIAL(info) << log_prefix << "Rate limit for " << link->dest << " in last 10s: " << link->throttled << " packets dropped, "
+                                            << link->coalesced << " coalesced, " << link->held.size() << " held";
+                    link->throttled = link->coalesced = 0;
+                }
+                if (link->spool.dropped() > link->spool_dropped_reported) {
+                    BOOST_LOG_TRIVIAL(error) << log_prefix << (link->spool.dropped() - link->spool_dropped_reported) << " spooled packets for "
+                                             << link->dest << " overwritten, spool full";
+                }
+                link->spool_dropped_reported = link->spool.dropped();
+            }
+            if (shard.inferred_off != 0) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Presumed " << shard.inferred_off << " silent radios off on shard " << shard.index
+                                        << " in last 10s, " << shard.units.size() << " tracked";
+                shard.inferred_off = 0;
+            }
+            if (shard.coalesced != 0) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Coalesced " << shard.coalesced << " packets into newer ones on shard " << shard.index << " in last 10s";
+                shard.coalesced = 0;
+            }
+            std::uint64_t dropped = shard.dropped.load(std::memory_order_relaxed);
+            if (dropped != shard.dropped_reported && shard.next_report != 0) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << (dropped - shard.dropped_reported) << " packets dropped on shard "
+                                         << shard.index << " in last 10s, queue full";
+            }
+            shard.dropped_reported = dropped;
+            shard.next_report = now + 10000000000ull;
+        }
+    }
+
+    // update_links()
+    //   Bring the shard's sockets in line with the configured destinations and their latest resolved addresses.
+    //   Unchanged links keep their sockets; a link whose destination has not resolved yet stays closed.
+    void update_links(Shard& shard, const UdpConfig& cfg)
+    {
+        std::uint64_t resolved_gen = resolve_generation.load(std::memory_order_acquire);
+        std::vector<std::unique_ptr<Link>> links;
+        for (const auto& dest : cfg.destinations) {
+            std::unique_ptr<Link> link;
+            for (auto& old : shard.links) {
+                if (old && old->dest == dest) {
+                    link = std::move(old);
+                    break;
+                }
+            }
+            if (!link) {
+                link.reset(new Link());
+                link->dest = dest;
+                parse_destination_options(dest, link->options);
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Shard " << shard.index << " sending to " << dest;
+                if (link->is_shm()) {
+                    open_ring(shard, *link, cfg, monotonic_ns());
+                }
+            }
+            update_spool(shard, *link, cfg, links.size() >= cfg.destinations.size() - cfg.subscribers);
+            update_history(*link, cfg);
+            update_limits(*link, cfg, links.size());
+
+            Resolution res{};
+            {
+                std::lock_guard<std::mutex> lock(resolve_mutex);
+                auto it = resolved.find(dest);
+                if (it != resolved.end()) {
+                    res = it->second;
+                }
+            }
+            if (res.addrlen != 0 &&
+                (res.addrlen != link->target.addrlen || std::memcmp(&res.addr, &link->target.addr, res.addrlen) != 0)) {
+                // New or changed address; a new socket too if the address family changed, or the socket is connected.
+                if (link->target.sock != INVALID_SOCKET &&
+                    (link->target.addr.ss_family != res.addr.ss_family || link->options.socktype != SOCK_DGRAM ||
+                     is_unicast(link->target.addr))) {
+                    ::close(link->target.sock);
+                    link->target.sock = INVALID_SOCKET;
+                    link->connecting = false;
+                    link->outbuf.clear();
+                }
+                link->target.addr = res.addr;
+                link->target.addrlen = res.addrlen;
+                link->retry_at = 0;
+                if (link->target.sock == INVALID_SOCKET) {
+                    if (!open_udp_socket(link->target, link->options)) {
+                        link_failed(*link, cfg, "socket", errno, monotonic_ns());
+                    } else {
+                        link->connecting = link->is_stream();
+                        link->connect_deadline = monotonic_ns() + 1000000ull * cfg.connect_timeout_ms;
+                    }
+                }
+            }
+            links.push_back(std::move(link));
+        }
+
+        // Links no longer configured close their sockets here.
+        shard.links = std::move(links);
+        shard.generation = cfg.generation;
+        shard.resolve_generation = resolved_gen;
+    }
+
+    // update_spool()
+    //   Open, reopen or close a link's spool to match spool_dir. The file is named after the shard and destination,
+    //   so a restart with the same configuration picks its backlog up again. Subscribers get no spool.
+    void update_spool(const Shard& shard, Link& link, const UdpConfig& cfg, bool subscriber)
+    {
+        if (link.catchup_rate != cfg.catchup_rate) {
+            link.catchup = TokenBucket(cfg.catchup_rate, static_cast<double>(cfg.batch_max));
+            link.catchup_rate = cfg.catchup_rate;
+        }
+
+        std::string path;
+        if (!cfg.spool_dir.empty() && !subscriber) {
+            path = cfg.spool_dir + "/shard" + std::to_string(shard.index) + "-";
+            for (char c : link.dest) {
+                path += std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-' ? c : '_';
+            }
+            path += ".spool";
+        }
+        if (path == link.spool_path) {
+            return;
+        }
+
+        link.spool.close();
+        link.spool_path = path;
+        if (path.empty()) {
+            return;
+        }
+        if (!link.spool.open(path, cfg.spool_bytes, sizeof(Packet))) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot open spool " << path << ": " << std::strerror(errno);
+        } else if (!link.spool.empty()) {
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "Spool " << path << " holds " << link.spool.bytes() << " bytes from a previous run";
+        }
+        link.spool_dropped_reported = link.spool.dropped();
+        link.spool_corrupt_reported = link.spool.corrupt();
+    }
+
+    // update_history()
+    //   Size a link's retransmission history, resend rate and parity group to the configuration. A new size
+    //   starts an empty history. Shared memory rings and TCP lose nothing in transit, so they need neither.
+    void update_history(Link& link, const UdpConfig& cfg)
+    {
+        bool lossless = link.is_shm() || link.is_stream();
+        std::size_t fec_k = cfg.framing_v2 && !lossless ? cfg.fec_k : 0;
+        if (link.fec.group() != fec_k) {
+            link.fec = FecEncoder(fec_k);
+        }
+        std::size_t size = cfg.framing_v2 && control_port != 0 && !lossless ? cfg.nack_history : 0;
+        if (link.history.size() != size) {
+            link.history.assign(size, Link::HistoryFrame{});
+        }
+        if (link.resend_rate != cfg.nack_rate) {
+            link.resend = TokenBucket(cfg.nack_rate, std::max(1.0, cfg.nack_rate / 10));
+            link.resend_rate = cfg.nack_rate;
+        }
+    }
+
+    // update_limits()
+    //   Rebuild a link's rate limit buckets for a new configuration, from the settings of destination d.
+    void update_limits(Link& link, const UdpConfig& cfg, std::size_t d)
+    {
+        if (link.limit_generation == cfg.generation) {
+            return;
+        }
+        link.limit_generation = cfg.generation;
+        const UdpConfig::RateLimit* limit = d < cfg.rate_limits.size() ? &cfg.rate_limits[d] : nullptr;
+        bool was_limited = link.limited;
+        link.limited = limit && limit->limited();
+        if (!link.limited) {
+            link.held.clear();
+            link.limit_settings = UdpConfig::RateLimit{};
+            return;
+        }
+        // Every reload (a subscription coming or going, say) lands here; only buckets whose limit changed refill.
+        if (!was_limited || limit->rate != link.limit_settings.rate || limit->burst != link.limit_settings.burst) {
+            link.limit = TokenBucket(limit->rate, limit->burst);
+        }
+        for (unsigned typ = 0; typ < 16; ++typ) {
+            if (!was_limited || limit->type_rate[typ] != link.limit_settings.type_rate[typ]) {
+                link.type_limits[typ] = TokenBucket(limit->type_rate[typ], std::max(1.0, limit->type_rate[typ]));
+            }
+        }
+        link.limit_settings = *limit;
+        link.coalesce = limit->coalesce;
+    }
+
+    // links_ready()
+    //   True once at least one destination can be sent to. Until then the sender leaves events queued.
+    bool links_ready(const Shard& shard) const
+    {
+        for (const auto& link : shard.links) {
+            if (link->ready()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // ********************************
+    // Destination resolution
+    // ********************************
+
+    // resolver_loop()
+    //   Resolver thread: resolve every destination as soon as it is configured, then again every
+    //   resolve_interval_s so hostname changes are picked up; failures are retried every resolve_retry_s.
+    //   DNS never blocks a callback or a sender. Senders are woken whenever an address changes.
+    void resolver_loop()
+    {
+        std::uint64_t resolved_for = 0;     // Config generation last resolved.
+        std::uint64_t next_refresh = 0;
+
+        std::unique_lock<std::mutex> lock(resolver_mutex);
+        while (!resolver_stop) {
+            std::uint64_t now = monotonic_ns();
+            std::vector<std::string> destinations;
+            std::uint64_t generation;
+            unsigned interval_s;
+            unsigned retry_s;
+            {
+                // A held snapshot cannot be freed, and DNS can take a while, so work from copies.
+                ReadSection section(config_readers);
+                const UdpConfig* cfg = config.load(std::memory_order_acquire);
+                generation = cfg->generation;
+                if (generation != resolved_for || now >= next_refresh) {
+                    destinations = cfg->destinations;
+                }
+                interval_s = cfg->resolve_interval_s;
+                retry_s = cfg->resolve_retry_s;
+            }
+
+            if (generation != resolved_for || now >= next_refresh) {
+                lock.unlock();
+                bool all_ok = resolve_destinations(destinations);
+                lock.lock();
+
+                resolved_for = generation;
+                next_refresh = monotonic_ns() + 1000000000ull * (all_ok ? interval_s : retry_s);
+            }
+
+            std::uint64_t wait_ns = next_refresh > now ? next_refresh - now : 0;
+            resolver_cv.wait_for(lock, std::chrono::nanoseconds(wait_ns), [&] {
+                ReadSection section(config_readers);
+                return resolver_stop || config.load(std::memory_order_acquire)->generation != resolved_for;
+            });
+        }
+    }
+
+    // resolve_destinations()
+    //   Resolve every configured destination, publishing each change as soon as it is known so one slow name
+    //   never holds up another. A destination that fails to resolve keeps its previous address, if it had one.
+    //   Returns false if any failed.
+    bool resolve_destinations(const std::vector<std::string>& destinations)
+    {
+        bool all_ok = true;
+        for (const auto& dest : destinations) {
+            if (dest.rfind("shm://", 0) == 0) {
+                continue;                   // Nothing to resolve.
+            }
+            Resolution res{};
+            if (!resolve_udp_target(dest, res.addr, res.addrlen)) {
+                all_ok = false;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(resolve_mutex);
+                auto it = resolved.find(dest);
+                if (it != resolved.end() && it->second.addrlen == res.addrlen &&
+                    std::memcmp(&it->second.addr, &res.addr, res.addrlen) == 0) {
+                    continue;
+                }
+                resolved[dest] = res;
+                resolve_generation.fetch_add(1, std::memory_order_release);
+            }
+            for (auto& shard : shards) {
+                wake(*shard, true);
+            }
+        }
+
+        // Forget destinations that are no longer configured.
+        std::lock_guard<std::mutex> lock(resolve_mutex);
+        for (auto it = resolved.begin(); it != resolved.end(); ) {
+            if (std::find(destinations.begin(), destinations.end(), it->first) == destinations.end()) {
+                it = resolved.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return all_ok;
+    }
+
+    // ********************************
+    // Configuration snapshots
+    // ********************************
+
+    // build_config()
+    //   Build a snapshot from this plugin's JSON settings. Returns nullptr if the settings are invalid.
+    std::unique_ptr<UdpConfig> build_config(const json& settings)
+    {
+        std::unique_ptr<UdpConfig> cfg(new UdpConfig());
+        try {
+            cfg->unit_enabled = settings.value("unit_enabled", true);
+            cfg->default_types = cfg->unit_enabled ? ALL_UNIT_TYPES : 0;
+            resolve_system_types(settings, *cfg);
+            json destinations = settings.contains("destinations") ? settings.at("destinations")
+                                                                  : json::array({settings.value("destination", "udp://127.0.0.1:7767")});
+            {
+                std::lock_guard<std::mutex> lock(subscriptions_mutex);
+                for (const auto& sub : subscriptions) {
+                    destinations.push_back(sub.second.rule);
+                }
+                cfg->subscribers = subscriptions.size();
+            }
+            for (const auto& dest : destinations) {
+                cfg->destinations.push_back(dest.is_object() ? dest.at("uri").get<std::string>() : dest.get<std::string>());
+                UdpOptions options;
+                if (!parse_destination_options(cfg->destinations.back(), options)) {
+                    throw std::invalid_argument("invalid destination " + cfg->destinations.back());
+                }
+            }
+            compile_routes(destinations, *cfg);
+            compile_rate_limits(destinations, *cfg);
+            if (settings.contains("talkgroups")) {
+                cfg->talkgroups = IdFilter(settings.at("talkgroups"), TALKGROUP_ID_BITS);
+            }
+            if (settings.contains("radios")) {
+                cfg->radios = IdFilter(settings.at("radios"), RADIO_ID_BITS);
+            }
+            cfg->resolve_interval_s = std::max(1u, settings.value("resolve_interval_s", 300u));
+            cfg->resolve_retry_s = std::max(1u, settings.value("resolve_retry_s", 5u));
+            cfg->backoff_min_ms = std::max(1u, settings.value("backoff_min_ms", 100u));
+            cfg->backoff_max_ms = std::max(cfg->backoff_min_ms, settings.value("backoff_max_ms", 30000u));
+            cfg->connect_timeout_ms = std::max(1u, settings.value("connect_timeout_ms", 5000u));
+            cfg->drain_timeout_ms = settings.value("drain_timeout_ms", 2000u);
+            cfg->batch_max = std::max<std::size_t>(1, settings.value("batch_max", static_cast<std::size_t>(64)));
+            cfg->linger_us = settings.value("linger_us", 0u);
+            std::string framing = settings.value("framing", "legacy");
+            if (framing != "legacy" && framing != "v2") {
+                throw std::invalid_argument("framing must be \"legacy\" or \"v2\"");
+            }
+            cfg->framing_v2 = framing == "v2";
+            std::size_t frame_bytes = settings.value("frame_bytes", static_cast<std::size_t>(1400));
+            cfg->frame_packets = std::max<std::size_t>(1, std::min<std::size_t>(0xFFFF, (frame_bytes - std::min(frame_bytes, sizeof(FrameHeader))) / sizeof(Packet)));
+            if (settings.contains("nack")) {
+                const json& nack = settings.at("nack");
+                cfg->nack_history = nack.value("history", static_cast<std::size_t>(1024));
+                cfg->nack_types = nack.contains("types") ? parse_types(nack.at("types"), "nack")
+                                                         : static_cast<u16>((1u << Type::Unit_PTTP) | (1u << Type::Unit_On));
+                cfg->nack_rate = nack.value("rate", 200.0);
+            }
+            if (settings.contains("high_priority")) {
+                cfg->high_types = parse_types(settings.at("high_priority"), "high_priority");
+            }
+            cfg->unit_timeout_s = settings.value("unit_timeout_s", 0u);
+            cfg->roster_interval_s = settings.value("roster_interval_s", 0u);
+            if (settings.contains("snapshot")) {
+                const json& snapshot = settings.at("snapshot");
+                cfg->snapshots = true;
+                cfg->snapshot_interval_s = snapshot.value("interval_s", 0u);
+                cfg->snapshot_rate = std::max(1.0, snapshot.value("rate", 2000.0));
+            }
+            if (settings.contains("coalesce")) {
+                const json& coalesce = settings.at("coalesce");
+                cfg->coalesce_types = coalesce.contains("types") ? parse_types(coalesce.at("types"), "coalesce")
+                                                                 : static_cast<u16>(1u << Type::Unit_Location);
+                cfg->coalesce_ms = std::max(1u, coalesce.value("interval_ms", 1000u));
+            }
+            if (settings.contains("fec")) {
+                cfg->fec_k = settings.at("fec").value("k", static_cast<std::size_t>(8));
+            }
+            if (settings.contains("spool")) {
+                const json& spool = settings.at("spool");
+                cfg->spool_dir = spool.value("dir", "");
+                cfg->spool_bytes = std::max<std::uint64_t>(1, spool.value("size_mb", 64ull)) << 20;
+                cfg->spool_threshold = std::min(1.0, std::max(0.0, spool.value("threshold", 0.5)));
+                cfg->catchup_rate = spool.value("catchup_rate", 1000.0);
+            }
+        } catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid configuration: " << e.what();
+            return nullptr;
+        }
+
+        return cfg;
+    }
+
+    // parse_types()
+    //   Turn a list of type names into a mask with one bit per Type. Throws on an unknown name.
+    static u16 parse_types(const json& names, const std::string& where)
+    {
+        u16 mask = 0;
+        for (const auto& name : names) {
+            std::string type_name = name.get<std::string>();
+            u8 typ = 1;
+            while (typ <= Type::Group_Roster && type_name != TYPE_NAMES[typ]) {
+                ++typ;
+            }
+            if (typ > Type::Group_Roster) {
+                throw std::invalid_argument("unknown type '" + type_name + "' for " + where);
+            }
+            mask |= static_cast<u16>(1u << typ);
+        }
+        return mask;
+    }
+
+    // compile_routes()
+    //   Turn the rules of "destinations" entries written as objects, {"uri": ..., "types": [...], "talkgroups":
+    //   {...}, "systems": ["<short name>", ...]}, into UdpConfig's route tables. An entry without a rule takes
+    //   everything that rule would select.
+    void compile_routes(const json& destinations, UdpConfig& cfg)
+    {
+        std::size_t count = destinations.size();
+        for (const auto& dest : destinations) {
+            cfg.routed = cfg.routed || (dest.is_object() && (dest.contains("types") || dest.contains("talkgroups") || dest.contains("systems")));
+        }
+        if (!cfg.routed) {
+            return;
+        }
+        if (count > 64) {
+            throw std::invalid_argument("routing rules allow at most 64 destinations");
+        }
+
+        std::size_t systems = 0;
+        for (System* sys : tr_systems) {
+            systems = std::max(systems, static_cast<std::size_t>(sys->get_sys_num()) + 1);
+        }
+        cfg.route_systems.assign(systems, 0);
+        cfg.route_talkgroups.assign(count, IdFilter());
+
+        for (std::size_t d = 0; d < count; ++d) {
+            const json& dest = destinations.at(d);
+            std::uint64_t bit = 1ull << d;
+
+            u16 types = dest.is_object() && dest.contains("types") ? parse_types(dest.at("types"), "destination " + cfg.destinations[d]) : 0xFFFF;
+            for (unsigned typ = 0; typ < 16; ++typ) {
+                cfg.route_types[typ] |= (types >> typ) & 1 ? bit : 0;
+            }
+
+            if (dest.is_object() && dest.contains("talkgroups")) {
+                cfg.route_talkgroups[d] = IdFilter(dest.at("talkgroups"), TALKGROUP_ID_BITS);
+                cfg.route_filtered |= bit;
+            }
+
+            if (!dest.is_object() || !dest.contains("systems")) {
+                for (auto& mask : cfg.route_systems) {
+                    mask |= bit;
+                }
+                cfg.route_other_systems |= bit;
+                continue;
+            }
+            for (const auto& name : dest.at("systems")) {
+                bool found = false;
+                for (System* sys : tr_systems) {
+                    if (sys->get_short_name() == name.get<std::string>()) {
+                        cfg.route_systems[static_cast<std::size_t>(sys->get_sys_num())] |= bit;
+                        found = true;
+                    }
+                }
+                if (!found && !tr_systems.empty()) {
+                    BOOST_LOG_TRIVIAL(error) << log_prefix << "Destination " << cfg.destinations[d] << ": system " << name.get<std::string>()
+                                             << " matches no system short name";
+                }
+            }
+        }
+    }
+
+    // compile_rate_limits()
+    //   Read the "rate_limit" of "destinations" entries written as objects, e.g. {"rate": 200, "burst": 400,
+    //   "types": {"location": 20}, "overflow": "coalesce"}. burst defaults to one second's worth.
+    void compile_rate_limits(const json& destinations, UdpConfig& cfg)
+    {
+        for (std::size_t d = 0; d < destinations.size(); ++d) {
+            const json& dest = destinations.at(d);
+            if (!dest.is_object() || !dest.contains("rate_limit")) {
+                continue;
+            }
+            const json& settings = dest.at("rate_limit");
+            cfg.rate_limits.resize(destinations.size());
+            UdpConfig::RateLimit& limit = cfg.rate_limits[d];
+            limit.rate = settings.value("rate", 0.0);
+            limit.burst = settings.contains("burst") ? settings.at("burst").get<double>() : std::max(1.0, limit.rate);
+            if (limit.rate < 0 || limit.burst < 1) {
+                throw std::invalid_argument("rate_limit of " + cfg.destinations[d] + " needs a rate of at least 0 and a burst of at least 1");
+            }
+            // Bulk packets need 1 + reserve tokens, so the reserve must leave at least one of the burst to them.
+            limit.reserve = limit.burst >= 2 ? std::min(limit.burst / 10, limit.burst - 1) : 0;
+            if (settings.contains("types")) {
+                const json& types = settings.at("types");
+                for (auto it = types.begin(); it != types.end(); ++it) {
+                    u16 mask = parse_types(json::array({it.key()}), "rate_limit of " + cfg.destinations[d]);
+                    limit.type_rate[__builtin_ctz(mask)] = it.value().get<double>();
+                    if (limit.type_rate[__builtin_ctz(mask)] < 0) {
+                        throw std::invalid_argument("rate_limit of " + cfg.destinations[d] + " has a negative rate for " + it.key());
+                    }
+                }
+            }
+            std::string overflow = settings.value("overflow", "drop");
+            if (overflow != "drop" && overflow != "coalesce") {
+                throw std::invalid_argument("rate_limit overflow must be \"drop\" or \"coalesce\"");
+            }
+            limit.coalesce = overflow == "coalesce";
+        }
+    }
+
+    // resolve_system_types()
+    //   Turn "systems": {"<short name>": {"types": ["on", "join", ...]}} into a mask per system number, so a
+    //   handler rejects an unwanted event with one load and a bit test. unit_enabled = false still disables all.
+    void resolve_system_types(const json& settings, UdpConfig& cfg)
+    {
+        if (!settings.contains("systems")) {
+            return;
+        }
+        const json& systems = settings.at("systems");
+
+        for (auto it = systems.begin(); it != systems.end(); ++it) {
+            if (!it.value().contains("types")) {
+                continue;
+            }
+            u16 mask = parse_types(it.value().at("types"), "system " + it.key());
+
+            bool found = false;
+            for (System* sys : tr_systems) {
+                if (sys->get_short_name() != it.key()) {
+                    continue;
+                }
+                std::size_t sys_num = static_cast<std::size_t>(sys->get_sys_num());
+                if (cfg.system_types.size() <= sys_num) {
+                    cfg.system_types.resize(sys_num + 1, cfg.default_types);
+                }
+                cfg.system_types[sys_num] = cfg.unit_enabled ? mask : 0;
+                found = true;
+            }
+            // Before init() there are no systems yet; only complain once they are known.
+            if (!found && !tr_systems.empty()) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "\"systems\" entry " << it.key() << " matches no system short name";
+            }
+        }
+    }
+
+    // publish_config()
+    //   Make cfg the current snapshot. The previous one is retired, not freed, since a reader may still hold it;
+    //   it is tagged with the read phase, taken after the new snapshot is in place.
+    //   Caller holds reload_mutex (or has not started any other thread yet).
+    void publish_config(std::unique_ptr<UdpConfig> cfg)
+    {
+        const UdpConfig* old = config.load(std::memory_order_relaxed);
+        cfg->generation = old ? old->generation + 1 : 1;
+        config.store(cfg.release());
+
+        if (old) {
+            retired.emplace_back(config_readers.phase(), old);
+        }
+    }
+
+    // reclaim_retired()
+    //   Free the retired snapshots no reader can still hold, or all of them once nothing can be running. A
+    //   snapshot needs the read phase to move past its own and the readers of that phase to leave, so one retired
+    //   just now goes on a later call: the watcher and control threads call this periodically, reloads call it
+    //   too. Returns true if any are left.
+    bool reclaim_retired(bool all)
+    {
+        std::vector<const UdpConfig*> expired;
+        bool left;
+        {
+            std::lock_guard<std::mutex> lock(reload_mutex);
+            if (!all && !config_readers.quiescent()) {
+                return true;
+            }
+            std::uint64_t phase = config_readers.phase();
+            auto keep = retired.begin();
+            for (auto& entry : retired) {
+                if (all || entry.first < phase) {
+                    expired.push_back(entry.second);
+                } else {
+                    *keep++ = entry;
+                }
+            }
+            retired.erase(keep, retired.end());
+            left = !retired.empty();
+            if (left) {
+                config_readers.advance();
+            }
+        }
+        for (const UdpConfig* cfg : expired) {
+            delete cfg;
+        }
+        return left;
+    }
+
+    // read_settings()
+    //   config.json's settings for this plugin, overlaid with config_file if there is one.
+    bool read_settings(json& settings)
+    {
+        settings = base_config;
+        if (config_file.empty()) {
+            return true;
+        }
+
+        std::ifstream in(config_file);
+        if (!in) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot read config_file " << config_file;
+            return false;
+        }
+        try {
+            settings.update(json::parse(in));
+        } catch (const json::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid config_file " << config_file << ": " << e.what();
+            return false;
+        }
+        return true;
+    }
+
+    // assign_system_shards()
+    //   Systems go to shard (system number % shards) unless their "systems" entry names a "shard".
+    //   Shard assignment is fixed at startup.
+    void assign_system_shards()
+    {
+        json settings;
+        read_settings(settings);
+
+        std::size_t max_sys_num = 0;
+        for (System* sys : tr_systems) {
+            max_sys_num = std::max(max_sys_num, static_cast<std::size_t>(sys->get_sys_num()));
+        }
+        system_shard.assign(max_sys_num + 1, 0);
+        for (std::size_t i = 0; i < system_shard.size(); ++i) {
+            system_shard[i] = i % shards.size();
+        }
+
+        for (System* sys : tr_systems) {
+            std::size_t sys_num = static_cast<std::size_t>(sys->get_sys_num());
+            try {
+                unsigned shard = settings.at("systems").at(sys->get_short_name()).at("shard").get<unsigned>();
+                if (shard < shards.size()) {
+                    system_shard[sys_num] = shard;
+                } else {
+                    BOOST_LOG_TRIVIAL(error) << log_prefix << "System " << sys->get_short_name() << " shard " << shard << " out of range";
+                }
+            } catch (const json::exception&) {
+                // No explicit shard.
+            }
+            BOOST_LOG_TRIVIAL(info) << log_prefix << "System " << sys->get_short_name() << " on shard " << system_shard[sys_num] << endl;
+        }
+    }
+
+    // reload_config()
+    //   Rebuild the snapshot from config.json's settings overlaid with config_file, and publish it if valid.
+    bool reload_config()
+    {
+        json settings;
+        if (!read_settings(settings)) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(reload_mutex);
+            std::unique_ptr<UdpConfig> cfg = build_config(settings);
+            if (!cfg) {
+                return false;
+            }
+            publish_config(std::move(cfg));
+        }
+        // Whatever triggers reloads, remote subscribers included, old snapshots go once no reader can hold them.
+        reclaim_retired(false);
+        {
+            // Taking the lock orders this wake-up after any predicate check already in progress.
+            std::lock_guard<std::mutex> resolver_lock(resolver_mutex);
+        }
+        resolver_cv.notify_all();
+
+        BOOST_LOG_TRIVIAL(info) << log_prefix << "Configuration generation " << config.load(std::memory_order_relaxed)->generation << " active";
+        return true;
+    }
+
+    // watch_config_file()
+    //   Watcher thread: poll config_file and reload whenever it changes. Editors that replace the file are handled
+    //   too, since the inode is compared as well as the modification time.
+    void watch_config_file()
+    {
+        struct stat last{};
+        ::stat(config_file.c_str(), &last);
+
+        std::unique_lock<std::mutex> lock(watcher_mutex);
+        while (!watcher_cv.wait_for(lock, std::chrono::milliseconds(config_poll_ms), [this] { return watcher_stop; })) {
+            lock.unlock();
+
+            struct stat st{};
+            if (::stat(config_file.c_str(), &st) == 0 &&
+                (st.st_ino != last.st_ino || st.st_size != last.st_size ||
+                 st.st_mtim.tv_sec != last.st_mtim.tv_sec || st.st_mtim.tv_nsec != last.st_mtim.tv_nsec)) {
+                last = st;
+                reload_config();
+            }
+            reclaim_retired(false);
+
+            lock.lock();
+        }
+    }
+
+    // ********************************
+    // Control port
+    // ********************************
+
+    // open_control_socket()
+    //   Bind control_port on every address, IPv6 and IPv4 alike.
+    bool open_control_socket()
+    {
+        control_sock = ::socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (control_sock != -1) {
+            int no = 0;
+            ::setsockopt(control_sock, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+            sockaddr_in6 addr{};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr = in6addr_any;
+            addr.sin6_port = htons(static_cast<u16>(control_port));
+            if (::bind(control_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                ::close(control_sock);
+                control_sock = -1;
+            }
+        }
+        if (control_sock == -1) {
+            // No IPv6 on this host.
+            control_sock = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(static_cast<u16>(control_port));
+            if (control_sock != -1 && ::bind(control_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                ::close(control_sock);
+                control_sock = -1;
+            }
+        }
+        if (control_sock == -1) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot listen on control_port " << control_port << ": " << std::strerror(errno);
+            return false;
+        }
+
+        control_wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return control_wake_fd != -1;
+    }
+
+    // control_loop()
+    //   Control thread: receive requests from consumers and hand each to the shard it concerns. Nothing here
+    //   touches a socket a sender owns.
+    void control_loop()
+    {
+        pthread_setname_np(pthread_self(), "status_udp/ctl");
+
+        std::vector<char> buf(2048);
+        for (;;) {
+            pollfd pfds[2] = {{control_sock, POLLIN, 0}, {control_wake_fd, POLLIN, 0}};
+            int expire_ms = expire_subscriptions();
+            int apply_ms = apply_subscriptions();
+            // Snapshots retired by subscription changes are freed from here when there is no watcher to do it.
+            int reclaim_ms = reclaim_retired(false) ? config_poll_ms : -1;
+            auto sooner = [](int a, int b) { return a < 0 ? b : b < 0 ? a : std::min(a, b); };
+            int timeout_ms = sooner(sooner(expire_ms, apply_ms), reclaim_ms);
+            if (::poll(pfds, 2, timeout_ms) == -1 && errno != EINTR) {
+                break;
+            }
+            if (pfds[1].revents != 0) {
+                break;
+            }
+            if (pfds[0].revents == 0) {
+                continue;
+            }
+
+            ShardCommand cmd{};
+            socklen_t fromlen = sizeof(cmd.from);
+            ssize_t len = ::recvfrom(control_sock, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&cmd.from), &fromlen);
+            if (len > 0 && buf[0] == '{') {
+                if (subscriptions_enabled) {
+                    subscribe(std::string(buf.data(), static_cast<std::size_t>(len)), cmd.from, fromlen);
+                }
+                continue;
+            }
+            if (len == static_cast<ssize_t>(sizeof(SnapshotRequest))) {
+                // Every shard holds part of the state.
+                SnapshotRequest request;
+                std::memcpy(&request, buf.data(), sizeof(request));
+                if (!valid_snapshot_request(request)) {
+                    continue;
+                }
+                cmd.kind = ShardCommand::Snapshot;
+                cmd.port = request.port;
+                for (auto& shard : shards) {
+                    if (shard->commands.push(cmd)) {
+                        wake(*shard, true);
+                    }
+                }
+                continue;
+            }
+            if (len != static_cast<ssize_t>(sizeof(NackRequest))) {
+                continue;
+            }
+            std::memcpy(&cmd.nack, buf.data(), sizeof(cmd.nack));
+            if (!valid_nack(cmd.nack) || cmd.nack.instance != instance || cmd.nack.stream >= shards.size()) {
+                continue;
+            }
+
+            Shard& shard = *shards[cmd.nack.stream];
+            if (shard.commands.push(cmd)) {
+                wake(shard, true);
+            }
+        }
+    }
+
+    // cookie_for()
+    //   The cookie of a requester's host for a cookie period: a keyed hash, so only a host that receives our
+    //   replies can know it.
+    std::string cookie_for(const sockaddr_storage& from, std::uint64_t period) const
+    {
+        std::string input = host_string(from);
+        input.append(reinterpret_cast<const char*>(&period), sizeof(period));
+        char text[17];
+        std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(siphash24(cookie_key, input.data(), input.size())));
+        return text;
+    }
+
+    // subscribe()
+    //   Answer a JSON request on control_port. Every request carries the cookie of the requester's host,
+    //   {"cookie": "...", ...}; one without a valid cookie is only answered with {"cookie": "..."}, to repeat it
+    //   with. That stops a forged source address from pointing the feed at someone else, and since that answer is
+    //   never longer than the request and nothing else is answered unverified, the port cannot be used to reflect
+    //   traffic either.
+    //
+    //   {"subscribe": {"port": 7770, "lease_s": 60, "types": [...],
+    //   "talkgroups": {...}, "systems": [...]}} takes or renews a lease on udp://<requester>:<port>, with the
+    //   rules of a "destinations" entry; {"unsubscribe": {"port": 7770}} (or a lease_s of 0) ends it. Events go
+    //   only to the requester's own host. A changed subscription is published with the next configuration
+    //   snapshot (see apply_subscriptions()), so the senders pick the destination up like any other, and answered
+    //   once it is; a plain renewal only moves the expiry, and is answered at once.
+    void subscribe(const std::string& text, const sockaddr_storage& from, socklen_t fromlen)
+    {
+        json request = json::parse(text, nullptr, false);
+        if (request.is_discarded() || !request.is_object()) {
+            return;
+        }
+        std::uint64_t period = monotonic_ns() / COOKIE_PERIOD_NS;
+        auto cookie = request.find("cookie");
+        if (cookie == request.end() || !cookie->is_string() ||
+            (*cookie != cookie_for(from, period) && *cookie != cookie_for(from, period - 1))) {
+            std::string out = json{{"cookie", cookie_for(from, period)}}.dump();
+            if (out.size() <= text.size()) {
+                ::sendto(control_sock, out.data(), out.size(), 0, reinterpret_cast<const sockaddr*>(&from), fromlen);
+            }
+            return;
+        }
+
+        json reply;
+        try {
+            bool unsubscribe = request.contains("unsubscribe");
+            const json& args = unsubscribe ? request.at("unsubscribe") : request.at("subscribe");
+            unsigned port = args.at("port").get<unsigned>();
+            if (port == 0 || port > 0xFFFF) {
+                throw std::invalid_argument("port out of range");
+            }
+            std::string uri = "udp://" + host_string(from) + ":" + std::to_string(port);
+            unsigned lease_s = unsubscribe ? 0 : std::min(max_lease_s, args.value("lease_s", max_lease_s));
+
+            json rule = {{"uri", uri}};
+            for (const char* key : {"types", "talkgroups", "systems"}) {
+                if (args.contains(key)) {
+                    rule[key] = args.at(key);
+                }
+            }
+            if (lease_s != 0) {
+                // Fails here rather than in the next snapshot.
+                UdpConfig trial;
+                trial.destinations.push_back(uri);
+                compile_routes(json::array({rule}), trial);
+            }
+
+            bool changed = false;
+            Subscription previous;
+            bool existed = false;
+            {
+                std::lock_guard<std::mutex> lock(subscriptions_mutex);
+                auto it = subscriptions.find(uri);
+                existed = it != subscriptions.end();
+                if (existed) {
+                    previous = it->second;
+                }
+                if (lease_s == 0) {
+                    changed = existed;
+                    subscriptions.erase(uri);
+                } else {
+                    ReadSection section(config_readers);
+                    const UdpConfig* cfg = config.load(std::memory_order_acquire);
+                    if (!existed && std::find(cfg->destinations.begin(), cfg->destinations.end(), uri) != cfg->destinations.end()) {
+                        throw std::invalid_argument(uri + " is already a destination");
+                    }
+                    if (!existed && subscriptions.size() >= max_subscriptions) {
+                        throw std::invalid_argument("too many subscriptions");
+                    }
+                    changed = !existed || previous.rule != rule;
+                    Subscription& sub = subscriptions[uri];
+                    sub.rule = rule;
+                    sub.expires = monotonic_ns() + 1000000000ull * lease_s;
+                }
+            }
+
+            reply = lease_s == 0 ? json{{"unsubscribed", uri}} : json{{"subscribed", uri}, {"lease_s", lease_s}};
+            if (changed) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << (lease_s == 0 ? "Unsubscribed " : existed ? "Changed subscription " : "Subscribed ") << uri;
+                subscriptions_changed = true;
+                pending_replies.push_back(PendingReply{from, fromlen, reply.dump()});
+                return;
+            }
+        } catch (const std::exception& e) {
+            reply = {{"error", e.what()}};
+        }
+
+        std::string out = reply.dump();
+        ::sendto(control_sock, out.data(), out.size(), 0, reinterpret_cast<const sockaddr*>(&from), fromlen);
+    }
+
+    // apply_subscriptions()
+    //   Publish the subscription changes made since the last call, at most once per SUBSCRIPTION_RELOAD_NS, and
+    //   answer the requests behind them. If the reload fails they still stand and take effect with the next one,
+    //   but the requesters are told. Returns how long until the next reload may go, in ms, or -1 if none is due.
+    int apply_subscriptions()
+    {
+        if (!subscriptions_changed) {
+            return -1;
+        }
+        std::uint64_t now = monotonic_ns();
+        if (now < next_subscription_reload) {
+            return static_cast<int>((next_subscription_reload - now) / 1000000 + 1);
+        }
+        subscriptions_changed = false;
+        next_subscription_reload = now + SUBSCRIPTION_RELOAD_NS;
+
+        bool ok = reload_config();
+        std::string failed = json{{"error", "configuration reload failed, see the trunk-recorder log"}}.dump();
+        for (const PendingReply& reply : pending_replies) {
+            const std::string& out = ok ? reply.text : failed;
+            ::sendto(control_sock, out.data(), out.size(), 0, reinterpret_cast<const sockaddr*>(&reply.to), reply.tolen);
+        }
+        pending_replies.clear();
+        return -1;
+    }
+
+    // expire_subscriptions()
+    //   Drop subscriptions whose lease has run out, for apply_subscriptions() to publish. Returns how long the
+    //   control thread may sleep before the next one runs out, in ms, or -1 if there are none.
+    int expire_subscriptions()
+    {
+        std::uint64_t now = monotonic_ns();
+        std::uint64_t next = 0;
+        std::vector<std::string> expired;
+        {
+            std::lock_guard<std::mutex> lock(subscriptions_mutex);
+            for (auto it = subscriptions.begin(); it != subscriptions.end(); ) {
+                if (it->second.expires <= now) {
+                    expired.push_back(it->first);
+                    it = subscriptions.erase(it);
+                    continue;
+                }
+                next = next == 0 ? it->second.expires : std::min(next, it->second.expires);
+                ++it;
+            }
+        }
+        if (!expired.empty()) {
+            for (const auto& uri : expired) {
+                BOOST_LOG_TRIVIAL(info) << log_prefix << "Subscription of " << uri << " expired";
+            }
+            subscriptions_changed = true;
+        }
+        return next == 0 ? -1 : static_cast<int>((next - now) / 1000000 + 1);
+    }
+
+    // host_string()
+    //   An address's host as it goes in a URI: dotted IPv4 (for IPv4-mapped addresses too), or bracketed IPv6.
+    static std::string host_string(const sockaddr_storage& addr)
+    {
+        char text[INET6_ADDRSTRLEN] = {0};
+        if (addr.ss_family == AF_INET) {
+            ::inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr, text, sizeof(text));
+            return text;
+        }
+        const in6_addr& a6 = reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&a6)) {
+            ::inet_ntop(AF_INET, &a6.s6_addr[12], text, sizeof(text));
+            return text;
+        }
+        ::inet_ntop(AF_INET6, &a6, text, sizeof(text));
+        return std::string("[") + text + "]";
+    }
+
+    // same_host()
+    //   Whether two addresses are the same host, ignoring ports. IPv4-mapped IPv6 addresses match their IPv4 form.
+    static bool same_host(const sockaddr_storage& a, const sockaddr_storage& b)
+    {
+        auto v4 = [](const sockaddr_storage& s, in_addr& out) {
+            if (s.ss_family == AF_INET) {
+                out = reinterpret_cast<const sockaddr_in*>(&s)->sin_addr;
+                return true;
+            }
+            auto sin6 = reinterpret_cast<const sockaddr_in6*>(&s);
+            if (s.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+                std::memcpy(&out, &sin6->sin6_addr.s6_addr[12], sizeof(out));
+                return true;
+            }
+            return false;
+        };
+
+        in_addr a4, b4;
+        bool a_is_v4 = v4(a, a4);
+        bool b_is_v4 = v4(b, b4);
+        if (a_is_v4 || b_is_v4) {
+            return a_is_v4 && b_is_v4 && a4.s_addr == b4.s_addr;
+        }
+        return a.ss_family == AF_INET6 && b.ss_family == AF_INET6 &&
+               std::memcmp(&reinterpret_cast<const sockaddr_in6*>(&a)->sin6_addr,
+                           &reinterpret_cast<const sockaddr_in6*>(&b)->sin6_addr, sizeof(in6_addr)) == 0;
+    }
+
+    static u16 target_port(const sockaddr_storage& addr)
+    {
+        if (addr.ss_family == AF_INET) {
+            return ntohs(reinterpret_cast<const sockaddr_in*>(&addr)->sin_port);
+        }
+        if (addr.ss_family == AF_INET6) {
+            return ntohs(reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port);
+        }
+        return 0;
+    }
+
+    // parse_destination_options()
+    //   The socket options of a destination, whatever its scheme. Returns false, having logged why, if the URI
+    //   or one of its options is invalid.
+    bool parse_destination_options(const std::string& uri, UdpOptions& options) {
+        std::string path, host, port;
+        if (uri.rfind("shm://", 0) == 0) {
+            return parse_shm_uri(uri, options);
+        }
+        if (parse_unix_uri(uri, path, options.socktype)) {
+            return !path.empty();
+        }
+        return parse_udp_uri(uri, host, port, &options);
+    }
+
+    // parse_shm_uri()
+    //   Parse shm://name[?slots=N&slot_bytes=N&mode=0660&group=name], a shared memory ring (see shm_ring.h) of
+    //   `slots` frames of up to `slot_bytes` each, with permissions `mode` (octal) and owned by `group`. Returns
+    //   false for other schemes, or an invalid ring.
+    bool parse_shm_uri(const std::string& uri, UdpOptions& options) {
+        const std::string prefix = "shm://";
+        if (uri.rfind(prefix, 0) != 0) {
+            return false;
+        }
+        auto question = uri.find('?');
+        std::string name = uri.substr(prefix.size(), question == std::string::npos ? std::string::npos : question - prefix.size());
+        if (name.empty() || name.find('/') != std::string::npos) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid shared memory name in destination " << uri << endl;
+            return false;
+        }
+
+        std::stringstream params(question == std::string::npos ? "" : uri.substr(question + 1));
+        std::string param;
+        while (std::getline(params, param, '&')) {
+            auto eq = param.find('=');
+            std::string key = param.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : param.substr(eq + 1);
+            try {
+                if (key == "slots") {
+                    options.shm_slots = std::stoull(value);
+                } else if (key == "slot_bytes") {
+                    options.shm_slot_bytes = static_cast<std::uint32_t>(std::stoul(value));
+                } else if (key == "mode") {
+                    unsigned long mode = std::stoul(value, nullptr, 8);
+                    if (mode > 0777) {
+                        throw std::invalid_argument(value);
+                    }
+                    options.shm_mode = static_cast<mode_t>(mode);
+                } else if (key == "group") {
+                    options.shm_group = group_id(value);
+                } else {
+                    BOOST_LOG_TRIVIAL(error) << log_prefix << "Unknown option '" << key << "' in destination " << uri << endl;
+                    return false;
+                }
+            } catch (const std::exception&) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid value for '" << key << "' in destination " << uri << endl;
+                return false;
+            }
+        }
+        if (options.shm_slots == 0 || options.shm_slot_bytes < sizeof(FrameHeader) + sizeof(Packet)) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Shared memory ring too small in destination " << uri << endl;
+            return false;
+        }
+        options.shm_name = name;
+        return true;
+    }
+
+    // group_id()
+    //   The id of a group given by name or number. Throws if there is no such group.
+    static gid_t group_id(const std::string& name) {
+        if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            return static_cast<gid_t>(std::stoul(name));
+        }
+        group grp{};
+        group* found = nullptr;
+        std::vector<char> buf(16384);
+        if (::getgrnam_r(name.c_str(), &grp, buf.data(), buf.size(), &found) != 0 || found == nullptr) {
+            throw std::invalid_argument(name);
+        }
+        return grp.gr_gid;
+    }
+
+    // parse_unix_uri()
+    //   Parse unix:///path/to/socket (datagrams) or unix+seqpacket:///path/to/socket (a connected SOCK_SEQPACKET
+    //   socket). A path starting with @ names a socket in the abstract namespace. Returns false for other schemes.
+    static bool parse_unix_uri(const std::string& uri, std::string& path, int& socktype) {
+        const std::string dgram = "unix://";
+        const std::string seqpacket = "unix+seqpacket://";
+        if (uri.rfind(dgram, 0) == 0) {
+            path = uri.substr(dgram.size());
+            socktype = SOCK_DGRAM;
+            return true;
+        }
+        if (uri.rfind(seqpacket, 0) == 0) {
+            path = uri.substr(seqpacket.size());
+            socktype = SOCK_SEQPACKET;
+            return true;
+        }
+        return false;
+    }
+
+    // parse_udp_uri()
+    //   Parse udp://host[:port][?option=value&...], with default port 7767. IPv6 literals go in brackets, e.g.
+    //   udp://[ff02::1%eth0]:7767. Options are ttl, iface and loopback (see UdpOptions). tcp://host[:port] is
+    //   the same, with options mode (latency or throughput) and buffer_kb.
+    bool parse_udp_uri(const std::string& uri, std::string& host, std::string& port, UdpOptions* options = nullptr) {
+        const std::string prefix = "udp://";
+        bool tcp = uri.rfind("tcp://", 0) == 0;
+        if (uri.rfind(prefix, 0) != 0 && !tcp) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Destination URI must start with udp://, tcp://, unix://, unix+seqpacket:// or shm://" << endl;
+
+            return false;
+        }
+
+        auto without_scheme = uri.substr(prefix.size());
+        auto question = without_scheme.find('?');
+        std::string query = question == std::string::npos ? "" : without_scheme.substr(question + 1);
+        without_scheme = without_scheme.substr(0, question);
+
+        std::size_t colon;
+        if (!without_scheme.empty() && without_scheme[0] == '[') {
+            auto bracket = without_scheme.find(']');
+            if (bracket == std::string::npos) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Unterminated [ in destination " << uri << endl;
+                return false;
+            }
+            host = without_scheme.substr(1, bracket - 1);
+            colon = without_scheme.find(':', bracket);
+        } else {
+            colon = without_scheme.find_last_of(':');
+            host = without_scheme.substr(0, colon);
+        }
+        port = colon == std::string::npos ? "" : without_scheme.substr(colon + 1);
+        if (port.empty()) port = "7767"; // default, and handle udp://host:
+
+        std::stringstream params(query);
+        std::string param;
+        while (std::getline(params, param, '&')) {
+            auto eq = param.find('=');
+            std::string key = param.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : param.substr(eq + 1);
+            UdpOptions ignored;
+            UdpOptions& opts = options ? *options : ignored;
+            try {
+                if (tcp && key == "mode") {
+                    if (value != "latency" && value != "throughput") {
+                        throw std::invalid_argument(value);
+                    }
+                    opts.cork = value == "throughput";
+                } else if (tcp && key == "buffer_kb") {
+                    opts.tcp_buffer = std::stoul(value) * 1024;
+                } else if (key == "ttl") {
+                    opts.ttl = std::stoi(value);
+                } else if (key == "iface") {
+                    opts.iface = value;
+                } else if (key == "loopback") {
+                    opts.loopback = value == "1" || value == "true" ? 1 : 0;
+                } else {
+                    BOOST_LOG_TRIVIAL(error) << log_prefix << "Unknown option '" << key << "' in destination " << uri << endl;
+                    return false;
+                }
+            } catch (const std::exception&) {
+                BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid value for '" << key << "' in destination " << uri << endl;
+                return false;
+            }
+        }
+
+        if (options && tcp) {
+            options->socktype = SOCK_STREAM;
+        }
+        return !host.empty();
+    }
+
+    // resolve_udp_target()
+    //   Resolve a destination URI to an address. May block on DNS, so only the resolver thread calls it.
+    bool resolve_udp_target(const std::string& uri, sockaddr_storage& addr, socklen_t& addrlen) {
+        std::string path;
+        int socktype;
+        if (parse_unix_uri(uri, path, socktype)) {
+            return unix_address(path, addr, addrlen);
+        }
+
+        std::string host, port;
+        if (!parse_udp_uri(uri, host, port)) {
+            BOOST_LOG_TRIVIAL(error) << "Invalid URI format";
+            return false;
+        }
+
+        if (host == "0.0.0.0" || host == "::") {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Refusing to use unspecified address (" << host << ") as a destination";
+            return false;
+        }
+
+        addrinfo hints{};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags    = AI_NUMERICSERV;
+
+        addrinfo* res = nullptr;
+        int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "getaddrinfo failed for " << host << ":" << port
+                                     << " (" << gai_strerror(rc) << ")";
+            return false;
+        }
+
+        std::memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        addrlen = static_cast<socklen_t>(res->ai_addrlen);
+
+        ::freeaddrinfo(res);
+        return true;
+    }
+
+    // unix_address()
+    //   Build the address of a Unix domain socket path; a leading @ selects the abstract namespace.
+    bool unix_address(const std::string& path, sockaddr_storage& addr, socklen_t& addrlen) {
+        sockaddr_un* sun = reinterpret_cast<sockaddr_un*>(&addr);
+        if (path.empty() || path.size() >= sizeof(sun->sun_path)) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Invalid Unix socket path '" << path << "'";
+            return false;
+        }
+        std::memset(&addr, 0, sizeof(addr));
+        sun->sun_family = AF_UNIX;
+        std::memcpy(sun->sun_path, path.data(), path.size());
+        if (path[0] == '@') {
+            sun->sun_path[0] = '\0';
+            addrlen = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+        } else {
+            addrlen = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+        }
+        return true;
+    }
+
+    // open_udp_socket()
+    //   Open a socket suitable for target.addr. Never blocks; a tcp:// connect() completes in finish_connect().
+    bool open_udp_socket(UdpTarget& target, const UdpOptions& options) {
+        // Unix and TCP sockets block when the reader falls behind; a full socket must fail the send instead.
+        int flags = target.addr.ss_family == AF_UNIX || options.socktype == SOCK_STREAM ? SOCK_NONBLOCK | SOCK_CLOEXEC : SOCK_CLOEXEC;
+        target.sock = ::socket(target.addr.ss_family, options.socktype | flags, 0);
+        if (target.sock == INVALID_SOCKET) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "socket() failed";
+            return false;
+        }
+
+        if (options.socktype == SOCK_SEQPACKET &&
+            ::connect(target.sock, reinterpret_cast<const sockaddr*>(&target.addr), target.addrlen) != 0) {
+            int err = errno;
+            ::close(target.sock);
+            target.sock = INVALID_SOCKET;
+            errno = err;
+            return false;
+        }
+
+        if (options.socktype == SOCK_STREAM) {
+            // Latency: every batch leaves at once. Throughput: the kernel sends full segments, holding a partial
+            // one for at most 200 ms.
+            int yes = 1;
+            ::setsockopt(target.sock, IPPROTO_TCP, options.cork ? TCP_CORK : TCP_NODELAY, &yes, sizeof(yes));
+            if (::connect(target.sock, reinterpret_cast<const sockaddr*>(&target.addr), target.addrlen) != 0 && errno != EINPROGRESS) {
+                int err = errno;
+                ::close(target.sock);
+                target.sock = INVALID_SOCKET;
+                errno = err;
+                return false;
+            }
+            return true;
+        }
+
+        // Optional: enable broadcast if you're targeting a broadcast address
+        if (target.addr.ss_family == AF_INET) {
+            auto sin = reinterpret_cast<const sockaddr_in*>(&target.addr);
+            if (sin->sin_addr.s_addr == INADDR_BROADCAST) {
+                int yes = 1;
+                ::setsockopt(target.sock, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+            }
+        }
+
+        set_multicast_options(target, options);
+
+        // A unicast socket is connected so the ICMP errors of a collector that is down (port unreachable, host
+        // unreachable) fail the next send, which marks the link down and spools its traffic. Sends still name
+        // the address, which is the same one.
+        if (is_unicast(target.addr) &&
+            ::connect(target.sock, reinterpret_cast<const sockaddr*>(&target.addr), target.addrlen) != 0) {
+            int err = errno;
+            ::close(target.sock);
+            target.sock = INVALID_SOCKET;
+            errno = err;
+            return false;
+        }
+        return true;
+    }
+
+    // is_unicast()
+    //   Whether an address is a single IPv4 or IPv6 host, rather than a multicast group or broadcast.
+    static bool is_unicast(const sockaddr_storage& addr) {
+        if (addr.ss_family == AF_INET) {
+            in_addr_t a = ntohl(reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr.s_addr);
+            return !IN_MULTICAST(a) && a != INADDR_BROADCAST;
+        }
+        return addr.ss_family == AF_INET6 && !IN6_IS_ADDR_MULTICAST(&reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr);
+    }
+
+    // set_multicast_options()
+    //   Apply TTL, interface and loopback to a socket whose destination is a multicast group. A bad option is
+    //   logged and otherwise ignored, so the group still gets traffic through the default route.
+    void set_multicast_options(const UdpTarget& target, const UdpOptions& options) {
+        int rc = 0;
+        if (target.addr.ss_family == AF_INET) {
+            auto sin = reinterpret_cast<const sockaddr_in*>(&target.addr);
+            if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+                return;
+            }
+            if (options.ttl >= 0) {
+                int ttl = options.ttl;
+                rc |= ::setsockopt(target.sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+            }
+            if (options.loopback >= 0) {
+                int loop = options.loopback;
+                rc |= ::setsockopt(target.sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+            }
+            if (!options.iface.empty()) {
+                ip_mreqn mreq{};
+                if (::inet_pton(AF_INET, options.iface.c_str(), &mreq.imr_address) != 1) {
+                    mreq.imr_ifindex = static_cast<int>(::if_nametoindex(options.iface.c_str()));
+                }
+                rc |= (mreq.imr_ifindex == 0 && mreq.imr_address.s_addr == 0)
+                    ? -1 : ::setsockopt(target.sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+            }
+        } else if (target.addr.ss_family == AF_INET6) {
+            auto sin6 = reinterpret_cast<const sockaddr_in6*>(&target.addr);
+            if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr)) {
+                return;
+            }
+            if (options.ttl >= 0) {
+                int hops = options.ttl;
+                rc |= ::setsockopt(target.sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+            }
+            if (options.loopback >= 0) {
+                unsigned loop = static_cast<unsigned>(options.loopback);
+                rc |= ::setsockopt(target.sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+            }
+            if (!options.iface.empty()) {
+                unsigned ifindex = ::if_nametoindex(options.iface.c_str());
+                rc |= ifindex == 0 ? -1 : ::setsockopt(target.sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+            }
+        }
+
+        if (rc != 0) {
+            BOOST_LOG_TRIVIAL(error) << log_prefix << "Cannot apply multicast options (ttl " << options.ttl << ", iface '" << options.iface
+                                     << "', loopback " << options.loopback << "): " << std::strerror(errno);
+        }
     }
 
     // ********************************
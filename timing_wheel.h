@@ -0,0 +1,147 @@
+// Trunk-Recorder Status Over UDP Plugin - Timing Wheel
+// ********************************
+// Hierarchical timing wheel for very many timers that are mostly re-armed
+// rather than allowed to fire, like one inactivity timer per radio.
+// Scheduling, re-scheduling and cancelling are O(1): a timer is unlinked
+// from one slot list and linked into another. Advancing costs one slot per
+// tick, plus moving timers down a level once per level they pass through.
+//
+// Timers are numbered by the caller (an index into its own table) and time
+// is in whole ticks; the caller picks what a tick is.
+//
+//   Level 0: 256 slots of 1 tick
+//   Level n: 256 slots of 256^n ticks; 4 levels reach 2^32 ticks ahead.
+// ********************************
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class TimingWheel {
+    static constexpr unsigned BITS = 8;
+    static constexpr unsigned SLOTS = 1u << BITS;
+    static constexpr unsigned LEVELS = 4;
+    static constexpr std::uint32_t NONE = 0xFFFFFFFFu;
+
+    struct Node {
+        std::uint32_t next = NONE;
+        std::uint32_t prev = NONE;
+        std::uint32_t slot = NONE;          // level * SLOTS + index, or NONE when not scheduled.
+        std::uint64_t when = 0;
+    };
+
+    std::vector<Node> nodes;                // Indexed by timer id.
+    std::vector<std::uint32_t> heads;       // First node of each slot.
+    std::uint64_t now = 0;                  // Last tick expired.
+    std::size_t count = 0;
+
+    void link(std::uint32_t id) {
+        Node& n = nodes[id];
+        std::uint64_t delta = n.when - now;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= (std::uint64_t(1) << (BITS * (level + 1)))) {
+            ++level;
+        }
+        if (level + 1 == LEVELS && delta >= (std::uint64_t(1) << (BITS * LEVELS))) {
+            n.when = now + (std::uint64_t(1) << (BITS * LEVELS)) - 1;
+        }
+        n.slot = level * SLOTS + static_cast<std::uint32_t>((n.when >> (BITS * level)) & (SLOTS - 1));
+        n.prev = NONE;
+        n.next = heads[n.slot];
+        if (n.next != NONE) {
+            nodes[n.next].prev = id;
+        }
+        heads[n.slot] = id;
+    }
+
+    void unlink(std::uint32_t id) {
+        Node& n = nodes[id];
+        if (n.prev != NONE) {
+            nodes[n.prev].next = n.next;
+        } else {
+            heads[n.slot] = n.next;
+        }
+        if (n.next != NONE) {
+            nodes[n.next].prev = n.prev;
+        }
+        n.slot = NONE;
+    }
+
+    // Move every timer of a slot down to where it now belongs.
+    void cascade(unsigned level, unsigned index) {
+        std::uint32_t id = heads[level * SLOTS + index];
+        heads[level * SLOTS + index] = NONE;
+        while (id != NONE) {
+            std::uint32_t next = nodes[id].next;
+            link(id);
+            id = next;
+        }
+    }
+
+public:
+    explicit TimingWheel(std::uint64_t start = 0) : heads(LEVELS * SLOTS, NONE), now(start) {}
+
+    std::uint64_t time() const { return now; }
+    std::size_t size() const { return count; }
+    bool scheduled(std::uint32_t id) const { return id < nodes.size() && nodes[id].slot != NONE; }
+
+    // Restart the clock at `start`, with no timers.
+    void reset(std::uint64_t start) {
+        nodes.clear();
+        heads.assign(LEVELS * SLOTS, NONE);
+        now = start;
+        count = 0;
+    }
+
+    // Fire timer `id` at tick `when`, replacing any earlier schedule. A time
+    // already past fires on the next tick.
+    void schedule(std::uint32_t id, std::uint64_t when) {
+        if (id >= nodes.size()) {
+            nodes.resize(id + 1);
+        }
+        if (nodes[id].slot != NONE) {
+            unlink(id);
+        } else {
+            ++count;
+        }
+        nodes[id].when = when > now ? when : now + 1;
+        link(id);
+    }
+
+    void cancel(std::uint32_t id) {
+        if (scheduled(id)) {
+            unlink(id);
+            --count;
+        }
+    }
+
+    // Run the clock up to tick `to`, calling expired(id) for each timer that
+    // fires on the way. The callback may schedule or cancel timers.
+    template <typename F>
+    void advance(std::uint64_t to, F&& expired) {
+        if (count == 0 && to > now) {
+            now = to;
+            return;
+        }
+        while (now < to) {
+            ++now;
+            for (unsigned level = 1; level < LEVELS; ++level) {
+                if ((now & ((std::uint64_t(1) << (BITS * level)) - 1)) != 0) {
+                    break;
+                }
+                cascade(level, static_cast<unsigned>((now >> (BITS * level)) & (SLOTS - 1)));
+            }
+
+            std::uint32_t slot = static_cast<std::uint32_t>(now & (SLOTS - 1));
+            while (heads[slot] != NONE) {
+                std::uint32_t id = heads[slot];
+                unlink(id);
+                --count;
+                expired(id);
+            }
+            if (count == 0) {
+                now = to;
+            }
+        }
+    }
+};
@@ -0,0 +1,125 @@
+// Trunk-Recorder Status Over UDP Plugin - FEC Benchmark
+// ********************************
+// Measures what the parity frames cost: encode time per data frame on the
+// sender, and time per rebuilt frame on the receiver, for a few group sizes
+// and frame sizes. Every group loses one frame, which must come back intact.
+//
+//   status_udp_fec_bench [-n frames]
+// ********************************
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "../packet.h"
+
+using u64 = std::uint64_t;
+
+static u64 mono_ns() {
+    timespec ts{};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+}
+
+// The datagram the plugin would send for the encoder's current parity frame.
+static std::vector<char> parity_datagram(const FecEncoder& fec) {
+    std::vector<char> out(sizeof(FrameHeader) + sizeof(ParityInfo) + fec.data_len());
+    std::memcpy(out.data(), &fec.header(), sizeof(FrameHeader));
+    std::memcpy(out.data() + sizeof(FrameHeader), &fec.parity_info(), sizeof(ParityInfo));
+    std::memcpy(out.data() + sizeof(FrameHeader) + sizeof(ParityInfo), fec.data(), fec.data_len());
+    return out;
+}
+
+int main(int argc, char** argv) {
+    std::size_t n = 200000;
+    int opt;
+    while ((opt = ::getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n': n = std::size_t(std::atol(optarg)); break;
+            default:
+                std::fprintf(stderr, "usage: %s [-n frames]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    // A pool of distinct frames to cycle through.
+    const std::size_t pool = 1024;
+    std::vector<Packet> pkts(pool * 43);
+    for (std::size_t i = 0; i < pkts.size(); ++i) {
+        pkts[i].typ = Type(1 + i % 8);
+        pkts[i].radioId = u32(i * 2654435761u);
+        pkts[i].tgId = u16(i);
+        pkts[i].ts = u32(i);
+    }
+
+    std::printf("%4s %8s %14s %14s %10s\n", "k", "packets", "encode ns/frm", "repair ns/frm", "overhead");
+    bool ok = true;
+    for (std::size_t k : {4, 8, 16}) {
+        for (u16 count : {1, 8, 43}) {
+            FecEncoder enc(k);
+            FrameHeader hdr{};
+            hdr.instance = 1;
+            hdr.count = count;
+
+            // Encode only.
+            u64 t0 = mono_ns();
+            std::size_t groups = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                hdr.seq = u32(i);
+                groups += enc.add(hdr, &pkts[(i % pool) * 43]) ? 1 : 0;
+            }
+            if (groups != n / k) {
+                ok = false;
+            }
+            u64 encode_ns = mono_ns() - t0;
+
+            // Lose one frame per group and rebuild it from the parity frame.
+            FecEncoder enc2(k);
+            FecDecoder dec(4 * k);
+            FrameHeader rebuilt;
+            std::vector<Packet> out;
+            u64 repair_ns = 0;
+            std::size_t repaired = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                hdr.seq = u32(i);
+                const Packet* frame = &pkts[(i % pool) * 43];
+                if (i % k != (i / k) % k) {
+                    dec.add(hdr, frame);
+                }
+                if (!enc2.add(hdr, frame)) {
+                    continue;
+                }
+                std::vector<char> parity = parity_datagram(enc2);
+                u64 r0 = mono_ns();
+                bool good = dec.recover(parity.data(), parity.size(), rebuilt, out);
+                repair_ns += mono_ns() - r0;
+                u32 lost = u32(i - (k - 1) + (i / k) % k);
+                const Packet* expect = &pkts[(lost % pool) * 43];
+                if (!good || rebuilt.seq != lost || rebuilt.count != count ||
+                    std::memcmp(static_cast<const void*>(out.data()), expect, count * sizeof(Packet)) != 0) {
+                    ok = false;
+                }
+                ++repaired;
+            }
+
+            double frame_bytes = double(sizeof(FrameHeader) + count * sizeof(Packet));
+            double parity_bytes = double(sizeof(FrameHeader) + sizeof(ParityInfo) + count * sizeof(Packet));
+            std::printf("%4zu %8u %14.1f %14.1f %9.1f%%\n", k, unsigned(count),
+                        double(encode_ns) / double(n),
+                        repaired != 0 ? double(repair_ns) / double(repaired) : 0.0,
+                        100.0 * parity_bytes / (frame_bytes * double(k)));
+        }
+    }
+
+    if (!ok) {
+        std::printf("FAILED: a rebuilt frame did not match the lost one\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,280 @@
+// Trunk-Recorder Status Over UDP Plugin - Loss Monitor
+// ********************************
+// Listens where the plugin sends and reports, per sender stream, how many
+// frames arrived, were lost, arrived out of order or twice. Needs
+// "framing": "v2" on the plugin; legacy packets are only counted.
+//
+//   status_udp_monitor [-i interval_s] [-c count] [-n nack_port] <[host:]port | shm://name>
+//
+// With shm://name it reads the plugin's shared memory ring instead, as a
+// reader alongside any others, and also reports frames the ring overwrote
+// before the monitor got to them.
+//
+// With -n, every gap is answered with a NackRequest to the sender's control
+// port, so frames the plugin still has in its history are sent again.
+// Frames rebuilt from parity frames ("fec" on the plugin) count as received
+// and are reported as repaired.
+//
+// Prints one line per stream every interval, and a final summary after
+// `count` intervals or on Ctrl-C.
+// ********************************
+
+#include <algorithm>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../packet.h"
+#include "../shm_ring.h"
+
+using u64 = std::uint64_t;
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static u64 mono_ns() {
+    timespec ts{};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+}
+
+// Sender host only: the source port changes whenever the plugin reopens its socket.
+static std::string peer_name(const sockaddr_storage& addr) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    if (addr.ss_family == AF_INET) {
+        ::inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr, host, sizeof(host));
+    } else if (addr.ss_family == AF_INET6) {
+        ::inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr, host, sizeof(host));
+    }
+    return host;
+}
+
+static int open_listener(const std::string& where) {
+    std::string host, port = where;
+    auto colon = where.find_last_of(':');
+    if (colon != std::string::npos) {
+        host = where.substr(0, colon);
+        port = where.substr(colon + 1);
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+    }
+
+    addrinfo hints{};
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_PASSIVE;
+    addrinfo* res = nullptr;
+    int rc = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        std::fprintf(stderr, "getaddrinfo %s: %s\n", where.c_str(), gai_strerror(rc));
+        return -1;
+    }
+    int sock = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock >= 0) {
+        int size = 1 << 24;
+        ::setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if (::bind(sock, res->ai_addr, res->ai_addrlen) != 0) {
+            ::close(sock);
+            sock = -1;
+        }
+    }
+    ::freeaddrinfo(res);
+    return sock;
+}
+
+struct Stream {
+    SeqTracker seq;
+    u64 packets = 0;
+    u64 repaired = 0;
+    FecDecoder fec;
+    SeqTracker last;            // Counters at the previous report.
+    u64 last_packets = 0;
+    u64 last_repaired = 0;
+};
+
+static void report(std::map<std::string, Stream>& streams, u64 legacy, bool final) {
+    for (auto& entry : streams) {
+        Stream& s = entry.second;
+        const SeqTracker& now = s.seq;
+        std::printf("%-28s frames %8" PRIu64 "  packets %8" PRIu64 "  lost %6" PRIu64 "  repaired %6" PRIu64 "  late %6" PRIu64 "  dup %6" PRIu64 "  restarts %" PRIu64 "  loss %.4f%%\n",
+                    entry.first.c_str(),
+                    now.received - (final ? 0 : s.last.received),
+                    s.packets - (final ? 0 : s.last_packets),
+                    now.lost - (final ? 0 : s.last.lost),
+                    s.repaired - (final ? 0 : s.last_repaired),
+                    now.reordered - (final ? 0 : s.last.reordered),
+                    now.duplicates - (final ? 0 : s.last.duplicates),
+                    now.restarts,
+                    now.loss_rate() * 100);
+        s.last = now;
+        s.last_packets = s.packets;
+        s.last_repaired = s.repaired;
+    }
+    if (legacy != 0) {
+        std::printf("legacy packets (no sequence numbers): %" PRIu64 "\n", legacy);
+    }
+    std::fflush(stdout);
+}
+
+// Ask the sender to resend the frames [first, first + count) of a stream.
+static void send_nack(int sock, sockaddr_storage to, int nack_port, u16 listen_port,
+                      const FrameHeader& frame, u32 first, u32 count) {
+    if (to.ss_family == AF_INET) {
+        reinterpret_cast<sockaddr_in*>(&to)->sin_port = htons(u16(nack_port));
+    } else {
+        reinterpret_cast<sockaddr_in6*>(&to)->sin6_port = htons(u16(nack_port));
+    }
+    while (count != 0) {
+        NackRequest nack;
+        nack.instance  = frame.instance;
+        nack.stream    = frame.stream;
+        nack.count     = u16(std::min<u32>(count, 0xFFFF));
+        nack.first_seq = first;
+        nack.port      = listen_port;
+        ::sendto(sock, &nack, sizeof(nack), 0, reinterpret_cast<const sockaddr*>(&to),
+                 to.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+        first += nack.count;
+        count -= nack.count;
+    }
+}
+
+static void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [-i interval_s] [-c count] [-n nack_port] <[host:]port | shm://name>\n"
+        "  -i  seconds between reports (default 10)\n"
+        "  -c  exit after this many reports (default: run until Ctrl-C)\n"
+        "  -n  request lost frames again from the plugin's control_port\n",
+        argv0);
+}
+
+int main(int argc, char** argv) {
+    double interval_s = 10;
+    long count = -1;
+    int nack_port = 0;
+
+    int opt;
+    while ((opt = ::getopt(argc, argv, "i:c:n:h")) != -1) {
+        switch (opt) {
+            case 'i': interval_s = std::atof(optarg); break;
+            case 'c': count = std::atol(optarg); break;
+            case 'n': nack_port = std::atoi(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (argc - optind != 1 || interval_s <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::string where = argv[optind];
+    ShmRingReader ring;
+    if (where.rfind("shm://", 0) == 0) {
+        if (!ring.open("/" + where.substr(6))) {
+            std::fprintf(stderr, "cannot open %s: %s\n", where.c_str(), std::strerror(errno));
+            return 1;
+        }
+        nack_port = 0;
+    }
+    int sock = ring.is_open() ? ::socket(AF_INET, SOCK_DGRAM, 0) : open_listener(where);
+    if (sock < 0) {
+        std::fprintf(stderr, "cannot listen on %s: %s\n", where.c_str(), std::strerror(errno));
+        return 1;
+    }
+    sockaddr_storage local{};
+    socklen_t local_len = sizeof(local);
+    ::getsockname(sock, reinterpret_cast<sockaddr*>(&local), &local_len);
+    u16 listen_port = ntohs(local.ss_family == AF_INET ? reinterpret_cast<sockaddr_in*>(&local)->sin_port
+                                                       : reinterpret_cast<sockaddr_in6*>(&local)->sin6_port);
+
+    std::signal(SIGINT, [](int) { interrupted = 1; });
+    std::signal(SIGTERM, [](int) { interrupted = 1; });
+
+    std::map<std::string, Stream> streams;
+    u64 legacy = 0, invalid = 0;
+    std::vector<char> buf(std::max<std::size_t>(65536, ring.is_open() ? ring.slot_bytes() : 0));
+    u64 interval_ns = u64(interval_s * 1e9);
+    u64 next_report = mono_ns() + interval_ns;
+
+    while (!interrupted && count != 0) {
+        u64 now = mono_ns();
+        if (now >= next_report) {
+            report(streams, legacy, false);
+            next_report += interval_ns;
+            if (count > 0) {
+                --count;
+            }
+            continue;
+        }
+
+        sockaddr_storage from{};
+        socklen_t fromlen = sizeof(from);
+        ssize_t len;
+        if (ring.is_open()) {
+            len = ssize_t(ring.read(buf.data()));
+            if (len == 0) {
+                ring.wait(int((next_report - now) / 1000000) + 1);
+                continue;
+            }
+        } else {
+            pollfd pfd{sock, POLLIN, 0};
+            if (::poll(&pfd, 1, int((next_report - now) / 1000000) + 1) <= 0) {
+                continue;
+            }
+            len = ::recvfrom(sock, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&from), &fromlen);
+            if (len < 0) {
+                continue;
+            }
+        }
+
+        FrameHeader frame;
+        const Packet* pkts;
+        if (!decode_frame(buf.data(), std::size_t(len), frame, pkts)) {
+            ++invalid;
+            continue;
+        }
+        if (frame.version == 0) {
+            ++legacy;
+            continue;
+        }
+        Stream& s = streams[(ring.is_open() ? "shm" : peer_name(from)) + "/" + std::to_string(frame.stream)];
+        std::vector<Packet> rebuilt;
+        if (frame.flags & FRAME_PARITY) {
+            if (!s.fec.recover(buf.data(), std::size_t(len), frame, rebuilt)) {
+                continue;
+            }
+            ++s.repaired;
+        } else {
+            s.fec.add(frame, pkts);
+        }
+        u32 expected = s.seq.expected();
+        if (s.seq.update(frame) == SeqTracker::Gap && nack_port != 0) {
+            send_nack(sock, from, nack_port, listen_port, frame, expected, frame.seq - expected);
+        }
+        s.packets += frame.count;
+    }
+
+    std::printf("total:\n");
+    report(streams, legacy, true);
+    if (invalid != 0) {
+        std::printf("invalid datagrams: %" PRIu64 "\n", invalid);
+    }
+    if (ring.is_open()) {
+        std::printf("overwritten in the ring before they were read: %" PRIu64 "\n", ring.lost);
+    }
+    ::close(sock);
+    return 0;
+}
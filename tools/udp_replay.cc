@@ -0,0 +1,447 @@
+// Trunk-Recorder Status Over UDP Plugin - Traffic Replay
+// ********************************
+// Re-emits a captured packet stream to a UDP destination with the original
+// inter-packet timing, scaled by --speed, or as fast as possible.
+//
+//   status_udp_replay [-s speed|max] [-b batch] [-p port] <capture> <udp://host:port>
+//
+// <capture> is either a plugin journal (see "journal" in the plugin config)
+// or a classic libpcap file (tcpdump -w), from which the UDP payloads are
+// taken. Pacing uses absolute CLOCK_MONOTONIC deadlines so sleep error never
+// accumulates, and every packet already due is sent in one sendmmsg().
+// ********************************
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "../journal.h"
+
+using u8  = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+static u64 mono_ns() {
+    timespec ts{};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+}
+
+static void sleep_until(u64 deadline_ns) {
+    timespec ts{};
+    ts.tv_sec  = time_t(deadline_ns / 1000000000ull);
+    ts.tv_nsec = long(deadline_ns % 1000000000ull);
+    while (::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+// ********************************
+// Capture readers
+// ********************************
+
+// Minimal classic pcap reader: Ethernet (with VLAN tags), Linux cooked v1/v2,
+// BSD loopback and raw IP link types, IPv4/IPv6, UDP only.
+class PcapReader {
+    std::FILE* fp = nullptr;
+    bool swapped = false;
+    bool nanos = false;
+    u32 linktype = 0;
+    int dst_port = -1;
+    std::vector<u8> buf;
+
+    u32 rd32(u32 v) const { return swapped ? __builtin_bswap32(v) : v; }
+    static u16 be16(const u8* p) { return u16((p[0] << 8) | p[1]); }
+
+    // Returns the offset of the IP header inside a frame, or -1 if unknown.
+    long ip_offset(const u8* p, std::size_t n) const {
+        switch (linktype) {
+            case 1: {       // Ethernet
+                std::size_t off = 12;
+                while (off + 2 <= n && (be16(p + off) == 0x8100 || be16(p + off) == 0x88a8)) {
+                    off += 4;
+                }
+                return off + 2 <= n ? long(off + 2) : -1;
+            }
+            case 0:         // BSD loopback
+                return 4;
+            case 12:        // Raw IP
+            case 101:
+                return 0;
+            case 113:       // Linux cooked v1
+                return 16;
+            case 276:       // Linux cooked v2
+                return 20;
+            default:
+                return -1;
+        }
+    }
+
+    // Extracts the UDP payload of an IP datagram; returns false if it is not UDP.
+    bool udp_payload(const u8* p, std::size_t n, const u8*& out, std::size_t& out_len) const {
+        if (n < 1) {
+            return false;
+        }
+        std::size_t off = 0;
+        if ((p[0] >> 4) == 4) {
+            std::size_t ihl = std::size_t(p[0] & 0x0F) * 4;
+            if (n < 20 || ihl < 20 || n < ihl + 8 || p[9] != 17) {
+                return false;
+            }
+            // Non-first fragments carry no UDP header.
+            if ((be16(p + 6) & 0x1FFF) != 0) {
+                return false;
+            }
+            off = ihl;
+        } else if ((p[0] >> 4) == 6) {
+            if (n < 48 || p[6] != 17) {
+                return false;
+            }
+            off = 40;
+        } else {
+            return false;
+        }
+
+        const u8* udp = p + off;
+        if (dst_port >= 0 && be16(udp + 2) != dst_port) {
+            return false;
+        }
+        std::size_t udp_len = be16(udp + 4);
+        if (udp_len < 8 || off + udp_len > n) {
+            udp_len = n - off;
+        }
+        out = udp + 8;
+        out_len = udp_len - 8;
+        return true;
+    }
+
+public:
+    ~PcapReader() { if (fp != nullptr) std::fclose(fp); }
+
+    bool open(const std::string& path, int port) {
+        dst_port = port;
+        fp = std::fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        u32 hdr[6];
+        if (std::fread(hdr, sizeof(hdr), 1, fp) != 1) {
+            return false;
+        }
+        switch (hdr[0]) {
+            case 0xa1b2c3d4: break;
+            case 0xa1b23c4d: nanos = true; break;
+            case 0xd4c3b2a1: swapped = true; break;
+            case 0x4d3cb2a1: swapped = true; nanos = true; break;
+            default: return false;
+        }
+        linktype = rd32(hdr[5]) & 0x0FFFFFFF;
+        if (linktype != 0 && linktype != 1 && linktype != 12 && linktype != 101 &&
+            linktype != 113 && linktype != 276) {
+            std::fprintf(stderr, "unsupported pcap link type %u\n", linktype);
+            return false;
+        }
+        return true;
+    }
+
+    bool next(u64& ts_ns, std::string& data) {
+        for (;;) {
+            u32 rec[4];
+            if (std::fread(rec, sizeof(rec), 1, fp) != 1) {
+                return false;
+            }
+            u32 caplen = rd32(rec[2]);
+            buf.resize(caplen);
+            if (caplen != 0 && std::fread(buf.data(), caplen, 1, fp) != 1) {
+                return false;
+            }
+            long ip = ip_offset(buf.data(), buf.size());
+            const u8* payload = nullptr;
+            std::size_t len = 0;
+            if (ip < 0 || std::size_t(ip) >= buf.size() ||
+                !udp_payload(buf.data() + ip, buf.size() - std::size_t(ip), payload, len)) {
+                continue;
+            }
+            ts_ns = u64(rd32(rec[0])) * 1000000000ull + u64(rd32(rec[1])) * (nanos ? 1ull : 1000ull);
+            data.assign(reinterpret_cast<const char*>(payload), len);
+            return true;
+        }
+    }
+};
+
+// Wraps either capture format behind one next() call.
+class CaptureReader {
+    JournalReader journal;
+    PcapReader pcap;
+    bool is_journal = false;
+
+public:
+    bool open(const std::string& path, int port) {
+        char magic[4] = {0};
+        std::FILE* fp = std::fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        std::size_t n = std::fread(magic, 1, sizeof(magic), fp);
+        std::fclose(fp);
+
+        is_journal = n == sizeof(magic) && journal_magic(magic);
+        return is_journal ? journal.open(path) : pcap.open(path, port);
+    }
+
+    bool next(u64& ts_ns, std::string& data) {
+        return is_journal ? journal.next(ts_ns, data) : pcap.next(ts_ns, data);
+    }
+};
+
+// ********************************
+// Replay
+// ********************************
+
+static bool open_destination(const std::string& uri, int& sock, sockaddr_storage& addr, socklen_t& addrlen) {
+    std::string rest = uri.rfind("udp://", 0) == 0 ? uri.substr(6) : uri;
+    std::string host, port = "7767";
+    if (!rest.empty() && rest[0] == '[') {
+        auto close = rest.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        host = rest.substr(1, close - 1);
+        if (close + 1 < rest.size() && rest[close + 1] == ':') {
+            port = rest.substr(close + 2);
+        }
+    } else {
+        auto colon = rest.find_last_of(':');
+        host = rest.substr(0, colon);
+        if (colon != std::string::npos) {
+            port = rest.substr(colon + 1);
+        }
+    }
+
+    addrinfo hints{};
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        std::fprintf(stderr, "getaddrinfo %s:%s: %s\n", host.c_str(), port.c_str(), gai_strerror(rc));
+        return false;
+    }
+    sock = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    std::memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    addrlen = socklen_t(res->ai_addrlen);
+    ::freeaddrinfo(res);
+
+    if (sock < 0) {
+        return false;
+    }
+    int yes = 1;
+    ::setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+    return true;
+}
+
+static void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [-s speed|max] [-b batch] [-p port] <capture> <udp://host:port>\n"
+        "  -s  playback speed multiplier, or 'max' for no pacing (default 1)\n"
+        "  -b  maximum packets per sendmmsg() (default 64)\n"
+        "  -p  pcap only: replay only UDP packets sent to this port\n",
+        argv0);
+}
+
+// Lateness histogram with log buckets: 8 per power of two, so any quantile
+// is within 12.5% of the true value, in constant memory however long the
+// capture is.
+class LatencyHistogram {
+    static constexpr unsigned SUB = 8;
+    u64 buckets[64 * SUB] = {0};
+    u64 total = 0;
+    double sum = 0;
+    u64 largest = 0;
+
+    static unsigned bucket_of(u64 v) {
+        if (v < SUB) {
+            return unsigned(v);
+        }
+        unsigned log = 63u - unsigned(__builtin_clzll(v));
+        return (log - 2) * SUB + unsigned((v >> (log - 3)) & (SUB - 1));
+    }
+
+    // Upper bound of a bucket's values.
+    static u64 value_of(unsigned b) {
+        if (b < SUB) {
+            return b;
+        }
+        unsigned log = b / SUB + 2;
+        return ((u64(SUB + b % SUB) + 1) << (log - 3)) - 1;
+    }
+
+public:
+    void add(u64 v) {
+        ++buckets[bucket_of(v)];
+        ++total;
+        sum += double(v);
+        largest = std::max(largest, v);
+    }
+
+    bool empty() const { return total == 0; }
+    double mean() const { return total != 0 ? sum / double(total) : 0.0; }
+    u64 max() const { return largest; }
+
+    u64 percentile(double p) const {
+        u64 rank = std::min(total - 1, u64(p * double(total)));
+        u64 seen = 0;
+        for (unsigned b = 0; b < 64 * SUB; ++b) {
+            seen += buckets[b];
+            if (seen > rank) {
+                return std::min(value_of(b), largest);
+            }
+        }
+        return largest;
+    }
+};
+
+struct Pending {
+    u64 due_ns;
+    std::string data;
+};
+
+int main(int argc, char** argv) {
+    double speed = 1.0;
+    bool max_speed = false;
+    std::size_t batch_max = 64;
+    int port_filter = -1;
+
+    int opt;
+    while ((opt = ::getopt(argc, argv, "s:b:p:h")) != -1) {
+        switch (opt) {
+            case 's':
+                if (std::strcmp(optarg, "max") == 0) {
+                    max_speed = true;
+                } else {
+                    speed = std::atof(optarg);
+                }
+                break;
+            case 'b': batch_max = std::max(1, std::atoi(optarg)); break;
+            case 'p': port_filter = std::atoi(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (argc - optind != 2 || (!max_speed && speed <= 0)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    CaptureReader capture;
+    if (!capture.open(argv[optind], port_filter)) {
+        std::fprintf(stderr, "cannot read capture %s\n", argv[optind]);
+        return 1;
+    }
+
+    int sock = -1;
+    sockaddr_storage addr{};
+    socklen_t addrlen = 0;
+    if (!open_destination(argv[optind + 1], sock, addr, addrlen)) {
+        std::fprintf(stderr, "cannot open destination %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    std::vector<Pending> batch(batch_max);
+    std::vector<iovec> iov(batch_max);
+    std::vector<mmsghdr> msgs(batch_max);
+    LatencyHistogram lateness;          // ns past the deadline
+    u64 frames = 0, bytes = 0, send_errors = 0;
+
+    u64 first_ts = 0;
+    u64 start_ns = mono_ns();
+    auto due_of = [&](u64 ts) -> u64 {
+        // A record older than the first (a clock step while recording) is due at once.
+        return max_speed ? 0 : start_ns + u64(double(ts > first_ts ? ts - first_ts : 0) / speed);
+    };
+
+    Pending next{};
+    u64 ts = 0;
+    bool have = capture.next(ts, next.data);
+    first_ts = ts;
+    next.due_ns = due_of(ts);
+
+    while (have) {
+        if (!max_speed) {
+            sleep_until(next.due_ns);
+        }
+        u64 now = mono_ns();
+
+        // Everything already due goes out together.
+        std::size_t n = 0;
+        while (have && n < batch_max && (max_speed || next.due_ns <= now)) {
+            std::swap(batch[n], next);
+            ++n;
+            have = capture.next(ts, next.data);
+            next.due_ns = due_of(ts);
+        }
+
+        for (std::size_t i = 0; i < n; ++i) {
+            iov[i].iov_base = &batch[i].data[0];
+            iov[i].iov_len  = batch[i].data.size();
+            msgs[i] = mmsghdr{};
+            msgs[i].msg_hdr.msg_name    = &addr;
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+            msgs[i].msg_hdr.msg_iov     = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+
+        std::size_t sent = 0;
+        while (sent < n) {
+            int rc = ::sendmmsg(sock, msgs.data() + sent, unsigned(n - sent), 0);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Count the whole remainder as lost rather than spinning on a dead socket.
+                send_errors += n - sent;
+                break;
+            }
+            sent += std::size_t(rc);
+        }
+
+        for (std::size_t i = 0; i < sent; ++i) {
+            bytes += batch[i].data.size();
+            if (!max_speed) {
+                lateness.add(now > batch[i].due_ns ? now - batch[i].due_ns : 0);
+            }
+        }
+        frames += sent;
+    }
+
+    double elapsed = double(mono_ns() - start_ns) / 1e9;
+    double capture_span = double(ts > first_ts ? ts - first_ts : 0) / 1e9;
+    std::printf("frames:       %" PRIu64 " (%" PRIu64 " send errors)\n", frames, send_errors);
+    std::printf("bytes:        %" PRIu64 "\n", bytes);
+    std::printf("elapsed:      %.3f s (capture spans %.3f s)\n", elapsed, capture_span);
+    std::printf("rate:         %.0f pkt/s, %.3f Mbit/s\n",
+                elapsed > 0 ? double(frames) / elapsed : 0.0,
+                elapsed > 0 ? double(bytes) * 8 / elapsed / 1e6 : 0.0);
+
+    if (!lateness.empty()) {
+        auto us = [](u64 ns) { return double(ns) / 1e3; };
+        std::printf("jitter (us):  mean %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                    lateness.mean() / 1e3, us(lateness.percentile(0.50)), us(lateness.percentile(0.99)),
+                    us(lateness.percentile(0.999)), us(lateness.max()));
+    }
+
+    ::close(sock);
+    return send_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,332 @@
+// Trunk-Recorder Status Over UDP Plugin - Unit State
+// ********************************
+// What the plugin knows about each radio it has heard from: when it was
+// last seen, on which system and talkgroup. Radios often power off without
+// deregistering, so every radio has an inactivity timer on a TimingWheel,
+// re-armed by each event; one that runs out means the radio is presumed
+// off. Updating a radio is a hash lookup and an O(1) re-arm, never a scan.
+//
+// Records live in a vector and are reused through a free list, so a
+// record's index is stable for as long as the radio is tracked and doubles
+// as its timer id.
+//
+// The table also indexes radios by the talkgroup they are affiliated to, as
+// a sorted vector of radio ids per talkgroup: most talkgroups have a handful
+// of members, and a roster is then a straight copy.
+//
+// A table can be saved to a file and read back after a restart:
+//
+//   File: UnitFileHeader, then `count` UnitState records.
+// ********************************
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "timing_wheel.h"
+
+struct UnitState {
+    u32  p25Id = 0;
+    u32  radioId = 0;
+    u32  last_seen = 0;                     // UNIX epoch seconds of the last event.
+    u16  nac = 0;
+    u16  tgId = 0;                          // Talkgroup the radio last joined or keyed up on; 0 if none.
+    u16  sys_num = 0;
+    u8   last_typ = 0;                      // Type of the last event.
+    u8   in_use = 0;                        // 0 for a free record.
+    char alias[12] = {0};
+};
+
+static_assert(sizeof(UnitState) == 32, "UnitState must be 32 bytes");
+
+#pragma pack(push, 1)
+struct UnitFileHeader {
+    char          magic[4] = {'M', 'C', 'U', '1'};
+    std::uint32_t version = 1;
+    std::uint32_t record_bytes = sizeof(UnitState);
+    std::uint32_t saved_at = 0;             // UNIX epoch seconds.
+    std::uint64_t count = 0;                // Records after the header.
+    std::uint8_t  reserved[40] = {0};
+};
+#pragma pack(pop)
+
+static_assert(sizeof(UnitFileHeader) == 64, "UnitFileHeader must be 64 bytes");
+
+// The radios affiliated to one talkgroup.
+struct TalkgroupMembers {
+    u32 p25Id = 0;
+    u16 nac = 0;
+    u16 tgId = 0;
+    u16 sys_num = 0;
+    std::vector<u32> radios;                // Sorted.
+};
+
+class UnitTable {
+    std::vector<UnitState> units;
+    std::vector<u32> free_units;
+    std::unordered_map<std::uint64_t, u32> index;   // p25Id << 32 | radioId, to record.
+    TimingWheel wheel;                      // Ticks are epoch seconds.
+    std::unordered_map<std::uint64_t, TalkgroupMembers> groups;     // p25Id << 16 | tgId, to members.
+    std::unordered_map<std::uint64_t, TalkgroupMembers> emptied;    // Last member left since take_emptied().
+
+    static std::uint64_t key(u32 p25Id, u32 radioId) { return static_cast<std::uint64_t>(p25Id) << 32 | radioId; }
+    static std::uint64_t group_key(u32 p25Id, u16 tgId) { return static_cast<std::uint64_t>(p25Id) << 16 | tgId; }
+
+    void join(UnitState& u, u16 tgId) {
+        if (u.tgId == tgId) {
+            return;
+        }
+        leave(u);
+        u.tgId = tgId;
+        std::uint64_t k = group_key(u.p25Id, tgId);
+        TalkgroupMembers& g = groups[k];
+        if (g.radios.empty()) {
+            emptied.erase(k);
+            g.p25Id = u.p25Id;
+            g.nac = u.nac;
+            g.tgId = tgId;
+            g.sys_num = u.sys_num;
+        }
+        g.radios.insert(std::lower_bound(g.radios.begin(), g.radios.end(), u.radioId), u.radioId);
+    }
+
+    // The record of a radio, new if it has none.
+    u32 record(u32 p25Id, u32 radioId) {
+        auto found = index.find(key(p25Id, radioId));
+        if (found != index.end()) {
+            return found->second;
+        }
+        u32 i;
+        if (!free_units.empty()) {
+            i = free_units.back();
+            free_units.pop_back();
+        } else {
+            i = static_cast<u32>(units.size());
+            units.emplace_back();
+        }
+        index.emplace(key(p25Id, radioId), i);
+        return i;
+    }
+
+    void arm(u32 i, u32 timeout_s) {
+        if (timeout_s == 0) {
+            wheel.cancel(i);
+            return;
+        }
+        u32 last_seen = units[i].last_seen;
+        if (wheel.size() == 0 && wheel.time() < last_seen) {
+            wheel.reset(last_seen);         // Don't tick through the time nothing was scheduled.
+        }
+        wheel.schedule(i, static_cast<std::uint64_t>(last_seen) + timeout_s);
+    }
+
+    void leave(UnitState& u) {
+        if (u.tgId == 0) {
+            return;
+        }
+        auto found = groups.find(group_key(u.p25Id, u.tgId));
+        if (found != groups.end()) {
+            std::vector<u32>& radios = found->second.radios;
+            auto it = std::lower_bound(radios.begin(), radios.end(), u.radioId);
+            if (it != radios.end() && *it == u.radioId) {
+                radios.erase(it);
+            }
+            if (radios.empty()) {
+                emptied[found->first] = std::move(found->second);
+                groups.erase(found);
+            }
+        }
+        u.tgId = 0;
+    }
+
+public:
+    std::size_t size() const { return index.size(); }
+    bool empty() const { return index.empty(); }
+
+    // Record an event for the radio in pkt, from system sys_num, and re-arm
+    // its timer to fire `timeout_s` after the event (none if 0). A join or a
+    // PTT moves the radio to that talkgroup. A Unit_Off forgets the radio
+    // instead. Returns the record, or nullptr.
+    const UnitState* update(const Packet& pkt, u16 sys_num, u32 timeout_s) {
+        Type typ = base_type(pkt.typ);
+        if (typ == Type::Unit_Off) {
+            remove(pkt.p25Id, pkt.radioId);
+            return nullptr;
+        }
+
+        u32 i = record(pkt.p25Id, pkt.radioId);
+        UnitState& u = units[i];
+        u.p25Id = pkt.p25Id;
+        u.radioId = pkt.radioId;
+        u.last_seen = pkt.ts;
+        u.nac = pkt.nac;
+        u.sys_num = sys_num;
+        u.last_typ = typ;
+        u.in_use = 1;
+        std::memcpy(u.alias, pkt.alias, sizeof(u.alias));
+        if ((typ == Type::Unit_Join || typ == Type::Unit_PTTP) && pkt.tgId != 0) {
+            join(u, pkt.tgId);
+        }
+
+        arm(i, timeout_s);
+        return &u;
+    }
+
+    // Put back a radio read from a file, with its timer running from when it
+    // was last seen.
+    void restore(const UnitState& saved, u32 timeout_s) {
+        u32 i = record(saved.p25Id, saved.radioId);
+        UnitState& u = units[i];
+        leave(u);
+        u = saved;
+        u.in_use = 1;
+        u.tgId = 0;
+        if (saved.tgId != 0) {
+            join(u, saved.tgId);
+        }
+        arm(i, timeout_s);
+    }
+
+    bool remove(u32 p25Id, u32 radioId) {
+        auto found = index.find(key(p25Id, radioId));
+        if (found == index.end()) {
+            return false;
+        }
+        u32 i = found->second;
+        index.erase(found);
+        wheel.cancel(i);
+        leave(units[i]);
+        units[i] = UnitState{};
+        free_units.push_back(i);
+        return true;
+    }
+
+    // Run the clock up to `now` (epoch seconds). Each radio whose timer runs
+    // out is passed to expired(const UnitState&), then forgotten.
+    template <typename F>
+    void expire(u32 now, F&& expired) {
+        if (wheel.size() == 0) {
+            return;
+        }
+        wheel.advance(now, [&](std::uint32_t i) {
+            UnitState u = units[i];
+            remove(u.p25Id, u.radioId);
+            expired(u);
+        });
+    }
+
+    const TalkgroupMembers* members(u32 p25Id, u16 tgId) const {
+        auto found = groups.find(group_key(p25Id, tgId));
+        return found != groups.end() ? &found->second : nullptr;
+    }
+
+    // Call f(const TalkgroupMembers&) for every talkgroup with members.
+    template <typename F>
+    void for_each_group(F&& f) const {
+        for (const auto& group : groups) {
+            f(group.second);
+        }
+    }
+
+    // Call f(const TalkgroupMembers&) for every talkgroup emptied since the
+    // last call, with no radios.
+    template <typename F>
+    void take_emptied(F&& f) {
+        for (const auto& group : emptied) {
+            f(group.second);
+        }
+        emptied.clear();
+    }
+
+    // Call f(const UnitState&) for every radio tracked.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const UnitState& u : units) {
+            if (u.in_use) {
+                f(u);
+            }
+        }
+    }
+
+    // Write every radio to `path`, through a temporary file renamed over it,
+    // so a crash mid-write leaves the previous save. Returns false, with
+    // errno set, on failure.
+    bool save(const std::string& path, u32 now) const {
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        UnitFileHeader hdr;
+        hdr.saved_at = now;
+        hdr.count = index.size();
+        std::size_t size = sizeof(hdr) + hdr.count * sizeof(UnitState);
+        void* map = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        int err = errno;
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            ::unlink(tmp.c_str());
+            errno = err;
+            return false;
+        }
+
+        std::memcpy(map, &hdr, sizeof(hdr));
+        UnitState* out = reinterpret_cast<UnitState*>(static_cast<char*>(map) + sizeof(hdr));
+        for (const UnitState& u : units) {
+            if (u.in_use) {
+                *out++ = u;
+            }
+        }
+        ::munmap(map, size);
+        return ::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // Read the radios saved at `path` into `out`. Returns false, with errno
+    // set, if the file cannot be read or is not a saved table.
+    static bool read(const std::string& path, std::vector<UnitState>& out, u32& saved_at) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st{};
+        void* map = MAP_FAILED;
+        std::size_t size = 0;
+        if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(UnitFileHeader)) {
+            size = static_cast<std::size_t>(st.st_size);
+            map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        int err = errno;
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            errno = size == 0 ? EINVAL : err;
+            return false;
+        }
+
+        UnitFileHeader hdr;
+        std::memcpy(&hdr, map, sizeof(hdr));
+        bool valid = std::memcmp(hdr.magic, "MCU1", 4) == 0 && hdr.version == 1 && hdr.record_bytes == sizeof(UnitState) &&
+                     hdr.count == (size - sizeof(hdr)) / sizeof(UnitState);
+        if (valid) {
+            const UnitState* in = reinterpret_cast<const UnitState*>(static_cast<const char*>(map) + sizeof(hdr));
+            out.assign(in, in + hdr.count);
+            saved_at = hdr.saved_at;
+        }
+        ::munmap(map, size);
+        errno = valid ? 0 : EINVAL;
+        return valid;
+    }
+};